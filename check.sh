@@ -0,0 +1,210 @@
+#!/bin/bash
+# Decode the samples in each mode and compare with the outputs written by test.sh
+
+# Pool usage differs between the modes
+filter() {
+    tr -d '\r' | grep -v -e 'sizeof(JDEC)' -e 'Memory Pool' -e 'Total:'
+}
+
+# A pixel per line as "x y (value)", from the rectangles and the pixel rows of output_func
+pixels() {
+    tr -d '\r' | awk '
+        /^\([0-9]+,[0-9]+\)-\([0-9]+,[0-9]+\)$/ {
+            split($0, v, /[^0-9]+/)
+            x0 = v[2]; y = v[3]; n = v[5] - v[3] + 1
+            next
+        }
+        n > 0 {
+            x = x0
+            s = $0
+            while (match(s, /\([^)]*\)/)) {
+                p = substr(s, RSTART, RLENGTH)
+                gsub(/ /, "", p)
+                print x++, y, p
+                s = substr(s, RSTART + RLENGTH)
+            }
+            y++
+            n--
+        }' | sort
+}
+
+# The pixels of pixels() in the rectangle "x,y,w,h"
+clip() {
+    awk -v r="$1" 'BEGIN { split(r, v, ","); x1 = v[1] + v[3] - 1; y1 = v[2] + v[4] - 1 }
+        $1 >= v[1] && $1 <= x1 && $2 >= v[2] && $2 <= y1'
+}
+
+fail=0
+for img in samples/*.jpg; do
+    expected=samples/$(basename "$img" .jpg).txt
+    while read -r decoder args; do
+        if ! $decoder "$img" $args | filter | cmp -s - <(filter < "$expected"); then
+            echo "FAILED: $decoder $img $args"
+            fail=1
+        fi
+    done <<MODES
+./jpeg_decode
+./jpeg_decode rgb888 - --stream
+./jpeg_decode rgb888 - --prefetch
+./jpeg_decode rgb888 - --suspend=0
+./jpeg_decode rgb888 - --suspend=3
+./jpeg_decode rgb888 - --crop
+./jpeg_decode rgb888 - --stripe=off
+./jpeg_decode_scalar
+./jpeg_decode_sse2
+./jpeg_decode_fd2
+./jpeg_decode_fd2 rgb888 - --stream
+./jpeg_decode_szbuf32
+./jpeg_decode_szbuf32 rgb888 - --stream
+./jpeg_decode_szbuf32 rgb888 - --suspend=3
+./jpeg_decode_mt rgb888 - 1
+./jpeg_decode_mt rgb888 - 4
+./jpeg_decode_mt rgb888 - 4 --stream
+MODES
+
+    # The trace of the debug build, which has no pixel output
+    if ! ./jpeg_decode_debug "$img" | filter | cmp -s - <(filter < samples/$(basename "$img" .jpg)-debug.txt); then
+        echo "FAILED: ./jpeg_decode_debug $img"
+        fail=1
+    fi
+
+    # The bands have the pixels in the image only, which have to be the same in any band height
+    # and the same as those of the MCUs
+    band1=$(./jpeg_decode "$img" rgb888 - --band=1 | pixels)
+    band40=$(./jpeg_decode "$img" rgb888 - --band=40 | pixels)
+    if [ -z "$band1" ] || [ "$band1" != "$band40" ] || [ -n "$(pixels < "$expected" | comm -13 - <(echo "$band1"))" ]; then
+        echo "FAILED: ./jpeg_decode $img rgb888 - --band"
+        fail=1
+    fi
+
+    # The frame buffer has the pixels of the rectangle in the image exactly, from the odd columns too,
+    # and its padding is checked by main.c
+    for r in 13,7,49,27 3,5,9,4; do
+        buf=$(./jpeg_decode "$img" rgb888 "$r" --buffer | pixels)
+        if [ -z "$buf" ] || [ "$buf" != "$(echo "$band1" | clip "$r")" ]; then
+            echo "FAILED: ./jpeg_decode $img rgb888 $r --buffer"
+            fail=1
+        fi
+    done
+
+    # The workers write the same frame buffer in any order
+    for r in - 13,7,49,27 3,5,9,4; do
+        for nworker in 1 4; do
+            if ! ./jpeg_decode_mt "$img" rgb888 $r $nworker --buffer | filter |
+                 cmp -s - <(./jpeg_decode "$img" rgb888 $r --buffer | filter); then
+                echo "FAILED: ./jpeg_decode_mt $img rgb888 $r $nworker --buffer"
+                fail=1
+            fi
+        done
+    done
+
+    # Pixels out of the rectangle are undefined in the blocks on its edges, those in it (and in the image)
+    # have to be the same for the row-limited IDCTs of every kernel, including thin rectangles
+    size=$(echo "$band1" | awk '$1 >= w { w = $1 + 1 } $2 >= h { h = $2 + 1 } END { print w "," h }')
+    for r in 13,7,49,27 3,5,9,4 5,0,1,40 0,9,40,2; do
+        for decoder in ./jpeg_decode ./jpeg_decode_scalar ./jpeg_decode_sse2; do
+            out=$($decoder "$img" rgb888 "$r" | pixels | clip "$r" | clip "0,0,$size")
+            if [ -z "$out" ] || [ "$out" != "$(echo "$band1" | clip "$r")" ]; then
+                echo "FAILED: $decoder $img rgb888 $r"
+                fail=1
+            fi
+        done
+    done
+
+    # The reduced IDCTs: the rectangles in the scaled image have to be the same through the output function
+    # and the frame buffer, which has the pixels in the scaled image only
+    for scale in 1 2 3; do
+        full=$(./jpeg_decode "$img" rgb888 - --buffer --scale=$scale | pixels)
+        size=$(echo "$full" | awk '$1 >= w { w = $1 + 1 } $2 >= h { h = $2 + 1 } END { print w "," h }')
+        for r in "0,0,$size" 1,1,5,3 1,0,1,9; do
+            for decoder in ./jpeg_decode ./jpeg_decode_scalar; do
+                out=$($decoder "$img" rgb888 "$r" --scale=$scale | pixels | clip "$r" | clip "0,0,$size")
+                if [ -z "$out" ] || [ "$out" != "$(echo "$full" | clip "$r")" ] ||
+                   [ "$out" != "$($decoder "$img" rgb888 "$r" --buffer --scale=$scale | pixels)" ]; then
+                    echo "FAILED: $decoder $img rgb888 $r --scale=$scale"
+                    fail=1
+                fi
+            done
+        done
+    done
+
+    # Stripes are clipped to the rectangle and the image, in any width
+    for r in - 13,7,49,27 3,5,9,4; do
+        want=$band1
+        if [ "$r" != - ]; then
+            want=$(echo "$band1" | clip "$r")
+        fi
+        for span in 0 8 20; do
+            out=$(./jpeg_decode "$img" rgb888 "$r" --stripe=$span | pixels)
+            if [ -z "$out" ] || [ "$out" != "$want" ]; then
+                echo "FAILED: ./jpeg_decode $img rgb888 $r --stripe=$span"
+                fail=1
+            fi
+        done
+    done
+
+    # The overlapping rectangles decoded in a pass, through the output function or into buffers, have to be
+    # the same as each of them decoded alone
+    for mode in "" --buffer; do
+        out=$(./jpeg_decode "$img" rgb888 - --region=13,7,49,27 --region=3,5,9,4 --region=0,9,40,2 $mode)
+        i=0
+        for r in 13,7,49,27 3,5,9,4 0,9,40,2; do
+            reg=$(echo "$out" | awk -v i=$i '/^Region / { on = $2 == i; next } on' | pixels)
+            if [ -z "$reg" ] || [ "$reg" != "$(./jpeg_decode "$img" rgb888 "$r" --buffer | pixels)" ]; then
+                echo "FAILED: ./jpeg_decode $img rgb888 --region=$r $mode"
+                fail=1
+            fi
+            i=$((i + 1))
+        done
+    done
+
+    # A cropped stream has the pixels of the original in the rectangle aligned to the MCUs, which needs the
+    # MCUs out of it to be dropped and the DC predictors to be rebased at its edges
+    for r in 13,7,49,27 3,5,9,4 9,9,20,20 17,9,10,10 20,17,3,3; do
+        if [ -z "$(echo "$band1" | awk -v r=$r 'BEGIN { split(r, v, ",") } $1 == v[1] && $2 == v[2]')" ]; then
+            continue    # Out of the image
+        fi
+        out=$(./jpeg_decode "$img" rgb888 - --crop=$r --buffer)
+        crop=$(echo "$out" | sed -n 's/^Cropped to //p')
+        want=$(./jpeg_decode "$img" rgb888 "$crop" --buffer | pixels |
+               awk -v r="$crop" 'BEGIN { split(r, v, ",") } { print $1 - v[1], $2 - v[2], $3 }' | sort)
+        if [ -z "$crop" ] || [ -z "$want" ] || [ "$(echo "$out" | pixels)" != "$want" ]; then
+            echo "FAILED: ./jpeg_decode $img rgb888 - --crop=$r"
+            fail=1
+        fi
+    done
+
+    # The coefficients are printed in raster order, so both orders have to give the same blocks,
+    # each with the last non-zero zigzag index found by main.c as the eob
+    coef=$(./jpeg_decode "$img" rgb888 - --coef | grep ' eob ')
+    if [ -z "$coef" ] || [ "$coef" != "$(./jpeg_decode "$img" rgb888 - --coef=zigzag | grep ' eob ')" ] ||
+       echo "$coef" | grep -qv ' eob \([0-9]*\)/\1:'; then
+        echo "FAILED: ./jpeg_decode $img rgb888 - --coef"
+        fail=1
+    fi
+done
+
+# Truncated streams have to fail cleanly, both mapped in place and read by input_func
+trunc=$(mktemp)
+for img in samples/dense_yuv420.jpg samples/noise_yuv420_dri1.jpg; do
+    head -c $(($(stat -c %s "$img") * 65 / 100)) "$img" > "$trunc"
+    while read -r decoder args; do
+        $decoder "$trunc" $args > /dev/null
+        if [ $? -ne 1 ]; then
+            echo "FAILED: $decoder $img (truncated) $args"
+            fail=1
+        fi
+    done <<MODES
+./jpeg_decode
+./jpeg_decode rgb888 - --stream
+./jpeg_decode rgb888 8,8,16,200
+./jpeg_decode rgb888 8,8,16,200 --stream
+./jpeg_decode_mt rgb888 - 4
+MODES
+done
+rm -f "$trunc"
+
+if [ $fail -eq 0 ]; then
+    echo "All checks passed"
+fi
+exit $fail
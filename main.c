@@ -1,22 +1,225 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "tjpgd.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#define HAS_POSIX 1
+#else
+#define HAS_POSIX 0
+#endif
+
+#ifndef USE_MMAP
+#define USE_MMAP HAS_POSIX      // Map the file to decode it in place (0: read it by input_func)
+#endif
+#ifndef USE_PREFETCH
+#define USE_PREFETCH HAS_POSIX  // Read the next block in a thread while decoding the current one
+#endif
+
+// Input device of input_func
+typedef struct {
+    FILE *fp;
+    const uint8_t *data;        // Mapped file (NULL: read by input_func)
+    size_t size;                // Size of the mapped file
+    int starve;                 // Return no data on every other read (--suspend)
+    unsigned int nread;         // Number of reads
+    int eof;                    // The file has no more data
+    uint8_t *crop;              // Stream written by jd_crop_lossless (--crop)
+    size_t szcrop;              // Size of the cropped stream
+#if USE_PREFETCH
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *buf;               // Buffer to read in (NULL: no request)
+    int32_t len;                // Bytes to read, then bytes read
+    int done, quit;
+#endif
+} IODEV;
+
 
 
 // Dummy input/output functions for TJpgDec
 int32_t input_func(JDEC *jd, uint8_t *buf, int32_t len)
 {
-    FILE *fp = (FILE *)jd->device;
+    IODEV *dev = (IODEV *)jd->device;
+    FILE *fp = dev->fp;
+    int32_t n;
 
     JD_LOG("rd %d", len);
     if (buf) {
-        return fread(buf, 1, (size_t)len, fp);
+        if (dev->starve && (dev->nread++ & 1)) {
+            return 0;   // Starved, the decoder suspends and is called again
+        }
+        n = (int32_t)fread(buf, 1, (size_t)len, fp);
+        dev->eof = n == 0;
+        return n;
     } else {
         fseek(fp, len, SEEK_CUR);
         return len;
     }
 }
 
+// Move the file position for the decodes going back in the stream
+int seek_func(JDEC *jd, uint32_t ofs)
+{
+    FILE *fp = ((IODEV *)jd->device)->fp;
+
+    JD_LOG("seek %u", ofs);
+    return fseek(fp, (long)ofs, SEEK_SET) == 0;
+}
+
+// Append the cropped stream to the memory
+int32_t write_func(JDEC *jd, const uint8_t *data, int32_t len)
+{
+    IODEV *dev = (IODEV *)jd->device;
+    uint8_t *p = realloc(dev->crop, dev->szcrop + (size_t)len);
+
+    if (!p) {
+        return 0;
+    }
+    memcpy(p + dev->szcrop, data, (size_t)len);
+    dev->crop = p;
+    dev->szcrop += (size_t)len;
+    return len;
+}
+
+// Map the whole JPEG file into the memory (NULL: not available, read it by input_func)
+const uint8_t *map_file(FILE *fp, size_t *len)
+{
+#if USE_MMAP
+    struct stat st;
+    void *p;
+
+    if (fstat(fileno(fp), &st) != 0 || st.st_size <= 0) {
+        return NULL;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    *len = (size_t)st.st_size;
+    JD_LOG("map %zu", *len);
+    return (const uint8_t *)p;
+#else
+    (void)fp;
+    (void)len;
+    return NULL;
+#endif
+}
+
+void unmap_file(const uint8_t *data, size_t len)
+{
+#if USE_MMAP
+    if (data) {
+        munmap((void *)data, len);
+    }
+#endif
+}
+
+#if USE_PREFETCH
+// Reader thread: serves a read request at a time
+static void *prefetch_thread(void *arg)
+{
+    IODEV *dev = (IODEV *)arg;
+    uint8_t *buf;
+    int32_t n;
+
+    pthread_mutex_lock(&dev->lock);
+    for (;;) {
+        while (!dev->buf && !dev->quit) {
+            pthread_cond_wait(&dev->cond, &dev->lock);
+        }
+        if (!dev->buf) {
+            break;
+        }
+        buf = dev->buf;
+        n = dev->len;
+        pthread_mutex_unlock(&dev->lock);
+        n = (int32_t)fread(buf, 1, (size_t)n, dev->fp);
+        pthread_mutex_lock(&dev->lock);
+        dev->len = n;
+        dev->buf = NULL;
+        dev->done = 1;
+        pthread_cond_broadcast(&dev->cond);
+    }
+    pthread_mutex_unlock(&dev->lock);
+
+    return NULL;
+}
+
+// Start reading the next bytes of the file in the reader thread
+void prefetch_start(JDEC *jd, uint8_t *buf, int32_t len)
+{
+    IODEV *dev = (IODEV *)jd->device;
+
+    pthread_mutex_lock(&dev->lock);
+    dev->buf = buf;
+    dev->len = len;
+    dev->done = 0;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+// Wait for the read started by prefetch_start
+int32_t prefetch_wait(JDEC *jd)
+{
+    IODEV *dev = (IODEV *)jd->device;
+    int32_t n;
+
+    pthread_mutex_lock(&dev->lock);
+    while (!dev->done) {
+        pthread_cond_wait(&dev->cond, &dev->lock);
+    }
+    n = dev->len;
+    pthread_mutex_unlock(&dev->lock);
+
+    return n;
+}
+
+int prefetch_open(IODEV *dev)
+{
+    dev->buf = NULL;
+    dev->done = dev->quit = 0;
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->cond, NULL);
+    if (pthread_create(&dev->thread, NULL, prefetch_thread, dev) != 0) {
+        pthread_cond_destroy(&dev->cond);
+        pthread_mutex_destroy(&dev->lock);
+        return 0;
+    }
+    return 1;
+}
+
+// Stop the reader thread after the read in progress
+void prefetch_close(IODEV *dev)
+{
+    pthread_mutex_lock(&dev->lock);
+    dev->quit = 1;
+    pthread_cond_broadcast(&dev->cond);
+    pthread_mutex_unlock(&dev->lock);
+    pthread_join(dev->thread, NULL);
+    pthread_cond_destroy(&dev->cond);
+    pthread_mutex_destroy(&dev->lock);
+}
+#endif
+
+// Stop the reader thread, unmap and close the file
+void close_input(IODEV *dev, int prefetch)
+{
+#if USE_PREFETCH
+    if (prefetch) {
+        prefetch_close(dev);
+    }
+#else
+    (void)prefetch;
+#endif
+    unmap_file(dev->data, dev->size);
+    free(dev->crop);
+    fclose(dev->fp);
+}
+
 int output_func(JDEC *jd, void *bitmap, JRECT *rect)
 {
 #if JD_DEBUG
@@ -88,10 +291,297 @@ int output_func(JDEC *jd, void *bitmap, JRECT *rect)
     return 1;
 }
 
+// Raster index of each zigzag index
+static const uint8_t zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Print the coefficients of a block in raster order whichever order they are passed in (--coef)
+int coef_func(JDEC *jd, const JBLOCK *blk)
+{
+    int16_t c[64];
+    int i, eob = 0;
+
+    for (i = 0; i < 64; i++) {
+        if (jd->zigzag) {
+            c[zigzag[i]] = blk->coef[i];
+        } else {
+            c[i] = blk->coef[i];
+        }
+    }
+    for (i = 1; i < 64; i++) {
+        if (c[zigzag[i]]) {
+            eob = i;    // Last non-zero zigzag index
+        }
+    }
+    printf("%d %d,%d q%d eob %d/%d:", blk->cmp, blk->bx, blk->by, blk->qtid, blk->eob, eob);
+    for (i = 0; i < 64; i++) {
+        printf(" %d", c[i]);
+    }
+    printf("\n");
+
+    return 1;
+}
+
+// Decode the image in bands of the height and pass each of them to output_func (--band)
+JRESULT decode_bands(JDEC *jd, JRECT *rect, int height)
+{
+    static const int bpp[] = { 1, 2, 2, 3, 3, 4, 4 };
+    int32_t w, stride;
+    uint8_t *band;
+    JRECT r;
+    JRESULT res;
+
+    // Width of the rectangle clipped to the image, a band is up to an MCU row more than the height
+    w = jd->width;
+    if (rect) {
+        w = (rect->right < jd->width ? rect->right + 1 : jd->width) - rect->left;
+    }
+    stride = w > 0 ? w * bpp[jd->color] : 1;
+    band = malloc((size_t)stride * (height + jd->msy * 8));
+    if (!band) {
+        return JDR_MEM1;
+    }
+    res = jd_stream_begin(jd, rect, (uint16_t)height);
+    while (res == JDR_OK) {
+        res = jd_stream_next(jd, band, stride, &r);
+        if (res != JDR_OK || r.top > r.bottom) {
+            break;  // Empty rectangle after the last band
+        }
+        output_func(jd, band, &r);
+    }
+    free(band);
+
+    return res;
+}
+
+#define FB_PAD  3   // Pixels of padding around the rectangle in the frame buffer (--buffer)
+#define MAX_REGION  3   // Number of rectangles of jd_decomp_multi (--region)
+
+static const int color_bpp[] = { 1, 2, 2, 3, 3, 4, 4 };
+
+// Clip the rectangle (NULL: whole image) to the (scaled) image as jd_decomp_to_buffer does (0: out of the image)
+int clip_rect(JDEC *jd, const JRECT *rect, JRECT *r)
+{
+    r->left = r->top = 0;
+    r->right = ((jd->width + (1 << jd->scale) - 1) >> jd->scale) - 1;
+    r->bottom = ((jd->height + (1 << jd->scale) - 1) >> jd->scale) - 1;
+    if (rect) {
+        r->left = rect->left;
+        r->top = rect->top;
+        if (rect->right < r->right) {
+            r->right = rect->right;
+        }
+        if (rect->bottom < r->bottom) {
+            r->bottom = rect->bottom;
+        }
+    }
+    return r->left <= r->right && r->top <= r->bottom;
+}
+
+// Pass the rows of the rectangle in a buffer to output_func
+void output_rows(JDEC *jd, uint8_t *buf, int32_t stride, const JRECT *r)
+{
+    JRECT row;
+    int y;
+
+    for (y = r->top; y <= r->bottom; y++) {
+        row.left = r->left;
+        row.right = r->right;
+        row.top = row.bottom = y;
+        output_func(jd, buf + (y - r->top) * stride, &row);
+    }
+}
+
+// Decode the rectangle into a padded frame buffer by jd_decomp_to_buffer (jd_decomp_mt_fb with worker
+// threads), check that the padding is untouched and pass the rows to output_func (--buffer)
+#if JD_MTDECODE
+// Pool of the workers, the staged output of their restart intervals included
+int32_t mt_pool_size(JDEC *jd, int nworker)
+{
+    return nworker * (16384 + jd->nrst * 4 * (sizeof(JRECT) + 64 * 4));
+}
+#endif
+
+JRESULT decode_buffer(JDEC *jd, JRECT *rect, int nworker)
+{
+    int32_t w, h, stride, x, y, l = color_bpp[jd->color];
+    uint8_t *fb, *top;
+    JRECT r;
+    JRESULT res;
+
+    if (!clip_rect(jd, rect, &r)) {
+        return JDR_OK;  // Out of the image
+    }
+    w = r.right - r.left + 1;
+    h = r.bottom - r.top + 1;
+    stride = (w + 2 * FB_PAD) * l;
+    fb = malloc((size_t)stride * (h + 2 * FB_PAD));
+    if (!fb) {
+        return JDR_MEM1;
+    }
+    memset(fb, 0xA5, (size_t)stride * (h + 2 * FB_PAD));
+    top = fb + FB_PAD * stride + FB_PAD * l;
+
+#if JD_MTDECODE
+    if (nworker > 0) {
+        int32_t sz_mt = mt_pool_size(jd, nworker);
+        void *mtpool = malloc(sz_mt);
+
+        res = mtpool ? jd_decomp_mt_fb(jd, rect, top, stride, nworker, mtpool, sz_mt) : JDR_MEM1;
+        free(mtpool);
+    } else
+#endif
+    {
+        (void)nworker;
+        res = jd_decomp_to_buffer(jd, rect, top, stride);
+    }
+    for (y = 0; res == JDR_OK && y < h + 2 * FB_PAD; y++) {
+        for (x = 0; x < stride; x++) {
+            if ((y < FB_PAD || y >= h + FB_PAD || x < FB_PAD * l || x >= (w + FB_PAD) * l) && fb[y * stride + x] != 0xA5) {
+                printf("Padding of the frame buffer is overwritten at byte %d of line %d\n", x, y);
+                res = JDR_PAR;
+                break;
+            }
+        }
+    }
+    if (res == JDR_OK) {
+        output_rows(jd, top, stride, &r);
+    }
+    free(fb);
+
+    return res;
+}
+
+// Rectangles of jd_decomp_multi clipped to the image and their pixels
+static JRECT region_rect[MAX_REGION];
+static uint8_t *region_buf[MAX_REGION];
+static int32_t region_stride[MAX_REGION];
+
+// Output function of the regions, keeps the pixels of the block in the region being output
+int region_func(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    int i = jd->iregion, l = color_bpp[jd->color];
+    const JRECT *r = &region_rect[i];
+    int x0 = rect->left > r->left ? rect->left : r->left;
+    int x1 = rect->right < r->right ? rect->right : r->right;
+    int y;
+
+    for (y = rect->top; y <= rect->bottom; y++) {
+        if (y >= r->top && y <= r->bottom && x0 <= x1) {
+            memcpy(region_buf[i] + (y - r->top) * region_stride[i] + (x0 - r->left) * l,
+                   (uint8_t *)bitmap + ((y - rect->top) * (rect->right - rect->left + 1) + x0 - rect->left) * l,
+                   (size_t)(x1 - x0 + 1) * l);
+        }
+    }
+    return 1;
+}
+
+// Decode the rectangles in a pass by jd_decomp_multi, into buffers or through region_func, and pass
+// each of them to output_func after a "Region n" line (--region)
+JRESULT decode_regions(JDEC *jd, JREGION *region, int nregion, int buffer)
+{
+    JRESULT res = JDR_OK;
+    int i;
+
+    for (i = 0; i < nregion; i++) {
+        region_buf[i] = NULL;
+        if (clip_rect(jd, &region[i].rect, &region_rect[i])) {
+            region_stride[i] = (region_rect[i].right - region_rect[i].left + 1) * color_bpp[jd->color];
+            region_buf[i] = malloc((size_t)region_stride[i] * (region_rect[i].bottom - region_rect[i].top + 1));
+            if (!region_buf[i]) {
+                res = JDR_MEM1;
+            }
+        }
+        region[i].outfunc = buffer ? NULL : region_func;
+        region[i].buf = region_buf[i];
+        region[i].stride = region_stride[i];
+    }
+    if (res == JDR_OK) {
+        res = jd_decomp_multi(jd, region, (uint8_t)nregion);
+    }
+    for (i = 0; i < nregion; i++) {
+        if (res == JDR_OK) {
+            printf("Region %d\n", i);
+            if (region_buf[i]) {
+                output_rows(jd, region_buf[i], region_stride[i], &region_rect[i]);
+            }
+        }
+        free(region_buf[i]);
+    }
+
+    return res;
+}
+
 int main(int argc, char *argv[])
 {
+    int i, n, stream = 0, suspend = -1, use_prefetch = 0, crop = 0, band = 0, coef = 0, buffer = 0, scale = 0, stripe = -1;
+    int nregion = 0, x, y, w, h;
+    JREGION region[MAX_REGION];
+    JRECT crect;
+
+    // Take the options out, the rest are positional
+    for (i = n = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;     // Read the file by input_func even if it can be mapped
+        } else if (strcmp(argv[i], "--prefetch") == 0) {
+            use_prefetch = stream = 1;  // Read the file by input_func with the reader thread
+        } else if (strncmp(argv[i], "--band=", 7) == 0) {
+            band = atoi(argv[i] + 7);   // Decode in bands of the height by jd_stream_next
+        } else if (strcmp(argv[i], "--coef") == 0 || strcmp(argv[i], "--coef=zigzag") == 0) {
+            coef = argv[i][6] ? 2 : 1;  // Print the coefficients by jd_decomp_coef in raster or zigzag order
+        } else if (strcmp(argv[i], "--buffer") == 0) {
+            buffer = 1;     // Decode into a padded frame buffer by jd_decomp_to_buffer
+        } else if (strncmp(argv[i], "--stripe=", 9) == 0) {
+            // Output per stripe of the width by jd_set_stripe, "off": set and turned off by jd_clear_stripe
+            stripe = strcmp(argv[i] + 9, "off") == 0 ? -2 : atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--scale=", 8) == 0) {
+            scale = atoi(argv[i] + 8);  // Output 1/2^scale of the image, the rectangle is in the scaled image
+        } else if (strncmp(argv[i], "--region=", 9) == 0) {
+            // Rectangles decoded in a pass by jd_decomp_multi, into buffers with --buffer
+            if (nregion == MAX_REGION || sscanf(argv[i] + 9, "%d,%d,%d,%d", &x, &y, &w, &h) != 4) {
+                fprintf(stderr, "Invalid region: %s\n", argv[i]);
+                return 1;
+            }
+            region[nregion].rect.left = x;
+            region[nregion].rect.top = y;
+            region[nregion].rect.right = x + w - 1;
+            region[nregion].rect.bottom = y + h - 1;
+            nregion++;
+        } else if (strcmp(argv[i], "--crop") == 0) {
+            crop = 1;       // Crop the whole image losslessly and decode the new stream instead
+        } else if (strncmp(argv[i], "--crop=", 7) == 0) {
+            // Crop the rectangle losslessly, the new stream covers it aligned to the MCUs
+            if (sscanf(argv[i] + 7, "%d,%d,%d,%d", &x, &y, &w, &h) != 4) {
+                fprintf(stderr, "Invalid crop rectangle: %s\n", argv[i]);
+                return 1;
+            }
+            crect.left = x;
+            crect.top = y;
+            crect.right = x + w - 1;
+            crect.bottom = y + h - 1;
+            crop = 2;
+        } else if (strncmp(argv[i], "--suspend=", 10) == 0) {
+            suspend = atoi(argv[i] + 10);   // MCU budget per call, and input_func starves every other read
+            stream = 1;     // Not prefetched, jd_set_suspend cannot be combined with jd_set_prefetch
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+    argc = n;
+    if (suspend >= 0 && use_prefetch) {
+        fprintf(stderr, "--suspend cannot be combined with --prefetch\n");
+        return 1;
+    }
+
     if (argc < 2) {
-        printf("Usage: %s <jpg_file>, \n", argv[0]);
+        printf("Usage: %s <jpg_file> [color] [x,y,w,h | -] [threads] [--stream] [--prefetch] [--suspend=budget] [--crop[=x,y,w,h]] [--band=height] [--coef[=zigzag]] [--buffer] [--scale=0..3] [--region=x,y,w,h]... [--stripe=span|off]\n", argv[0]);
         return 1;
     }
 
@@ -101,15 +591,16 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    uint8_t work[8192]; // Work buffer
+    uint8_t work[16384]; // Work buffer
+    IODEV dev = { fp };
+    int prefetch = 0;
     JDEC jd;
     JRESULT res;
 
     JCOLOR color;
     JRECT *rect = NULL, _rect;
 
-    if (argc > 3) {
-        int x, y, w, h;
+    if (argc > 3 && strcmp(argv[3], "-") != 0) {
         int ret = sscanf(argv[3], "%d,%d,%d,%d", &x, &y, &w, &h);
         if (ret == 4) {
             _rect.left = x;
@@ -149,25 +640,138 @@ int main(int argc, char *argv[])
     }
 
     printf("Preparing JPEG decoder...\n");
-    res = jd_prepare(&jd, input_func, work, sizeof(work), fp);
+    dev.data = stream ? NULL : map_file(fp, &dev.size);
+    if (dev.data) {
+        // Decode the mapped file in place, no stream input buffer
+        res = jd_prepare_mem(&jd, dev.data, dev.size, work, sizeof(work));
+    } else {
+        res = jd_prepare(&jd, input_func, work, sizeof(work), &dev);
+        if (res == JDR_OK) {
+            res = jd_set_seek(&jd, seek_func);
+        }
+    }
     if (res != JDR_OK) {
         printf("Failed to prepare JPEG decoder %u\n", res);
-        fclose(fp);
+        close_input(&dev, prefetch);
         return 1;
     }
+#if USE_PREFETCH
+    if (!dev.data && (!stream || use_prefetch) && prefetch_open(&dev)) {
+        // Overlap the file reads with the decoding
+        prefetch = 1;
+        if (jd_set_prefetch(&jd, prefetch_start, prefetch_wait) != JDR_OK) {
+            printf("Failed to enable input prefetch\n");
+        }
+    }
+#endif
+
+    if (crop) {
+        if (crop == 1) {
+            crect.left = crect.top = 0;
+            crect.right = jd.width - 1;
+            crect.bottom = jd.height - 1;
+        }
+        jd.device = &dev;   // Also for write_func on the mapped file
+        res = jd_crop_lossless(&jd, &crect, write_func);
+        if (res == JDR_OK) {
+            res = jd_prepare_mem(&jd, dev.crop, dev.szcrop, work, sizeof(work));
+        }
+        if (res != JDR_OK) {
+            printf("Failed to crop JPEG image %u\n", res);
+            close_input(&dev, prefetch);
+            return 1;
+        }
+        if (crop == 2) {
+            // The new image is the rectangle aligned to the MCUs
+            printf("Cropped to %d,%d,%d,%d\n", crect.left, crect.top, crect.right - crect.left + 1, crect.bottom - crect.top + 1);
+        }
+    }
 
     jd_set_color(&jd, color);
+    if (jd_set_scale(&jd, (uint8_t)scale) != JDR_OK) {
+        printf("Failed to set the scale %d\n", scale);
+        close_input(&dev, prefetch);
+        return 1;
+    }
+
+    if (stripe != -1) {
+        res = jd_set_stripe(&jd, stripe < 0 ? 0 : (uint16_t)stripe);
+        if (res == JDR_OK && stripe < 0) {
+            res = jd_clear_stripe(&jd);
+        }
+        if (res != JDR_OK) {
+            printf("Failed to set the stripe output %u\n", res);
+            close_input(&dev, prefetch);
+            return 1;
+        }
+    }
+
+    if ((rect || nregion) && jd.nrst) {
+        /* Index restart intervals to jump to the rectangle directly */
+        res = jd_build_index(&jd);
+        if (res != JDR_OK) {
+            printf("Failed to build restart index %u\n", res);
+            close_input(&dev, prefetch);
+            return 1;
+        }
+    }
+
+    if (suspend >= 0) {
+        res = jd_set_suspend(&jd, (uint32_t)suspend);
+        if (res != JDR_OK) {
+            printf("Failed to enable suspension %u\n", res);
+            close_input(&dev, prefetch);
+            return 1;
+        }
+        dev.starve = 1;
+    }
 
     printf("\n\n\n");
 
     printf("Starting JPEG decompression...\n");
-    if (jd_decomp_rect(&jd, output_func, rect) != JDR_OK) {
-        printf("Failed to decode JPEG image\n");
-        fclose(fp);
-        return 1;
+#if JD_MTDECODE
+    if (argc > 4) {
+        /* Decode restart intervals with worker threads */
+        int nworker = atoi(argv[4]);
+
+        if (buffer) {
+            res = decode_buffer(&jd, rect, nworker);
+        } else {
+            int32_t sz_mt = mt_pool_size(&jd, nworker);
+            void *mtpool = malloc(sz_mt);
+
+            res = mtpool ? jd_decomp_mt(&jd, output_func, rect, nworker, mtpool, sz_mt) : JDR_MEM1;
+            free(mtpool);
+        }
+        if (res != JDR_OK) {
+            printf("Failed to decode JPEG image %u\n", res);
+            close_input(&dev, prefetch);
+            return 1;
+        }
+    } else
+#endif
+    {
+        if (coef) {
+            res = jd_decomp_coef(&jd, coef_func, rect, coef == 2);
+        } else if (nregion) {
+            res = decode_regions(&jd, region, nregion, buffer);
+        } else if (buffer) {
+            res = decode_buffer(&jd, rect, 0);
+        } else if (band > 0) {
+            res = decode_bands(&jd, rect, band);
+        } else {
+            do {    // Called again as long as suspended, unless the file has run out
+                res = jd_decomp_rect(&jd, output_func, rect);
+            } while (res == JDR_SUSPEND && !dev.eof);
+        }
+        if (res != JDR_OK) {
+            printf("Failed to decode JPEG image\n");
+            close_input(&dev, prefetch);
+            return 1;
+        }
     }
 
-    fclose(fp);
+    close_input(&dev, prefetch);
 
     printf("\n\n\n");
 
@@ -17,6 +17,21 @@
 
 #include "tjpgd.h"
 
+#if JD_MTDECODE
+#include <pthread.h>
+#endif
+
+#if JD_SIMD && JD_FASTDECODE >= 1 && defined(__SSE2__)
+#define JD_SIMD_X86     1   /* SSE2 kernels (the baseline of x86-64) */
+#include <immintrin.h>
+#else
+#define JD_SIMD_X86     0
+#endif
+#if JD_SIMD_X86 && JD_SIMD >= 2 && defined(__GNUC__)
+#define JD_SIMD_AVX2    1   /* AVX2 IDCT, selected at run time on the CPUs having it */
+#else
+#define JD_SIMD_AVX2    0
+#endif
 
 void jd_log(JDEC *jd);
 
@@ -152,6 +167,30 @@ static inline bool is_rect_intersect(const JRECT *r1, const JRECT *r2)
     return true;
 }
 
+/* Part of the block at rect in the target rectangle (NULL: whole block): columns x0..x1 and
+/  rows y0..y1 of the block. Returns false if no pixel of the block is in the rectangle. */
+static inline bool jd_block_span(const JRECT *rect, const JRECT *tgt_rect, int *x0, int *x1, int *y0, int *y1)
+{
+    *x0 = 0;
+    *y0 = 0;
+    *x1 = rect->right - rect->left;
+    *y1 = rect->bottom - rect->top;
+    if (tgt_rect) {
+        if (tgt_rect->left > rect->left) {
+            *x0 = tgt_rect->left - rect->left;
+        }
+        if (tgt_rect->top > rect->top) {
+            *y0 = tgt_rect->top - rect->top;
+        }
+        if (tgt_rect->right < rect->right) {
+            *x1 = tgt_rect->right - rect->left;
+        }
+        if (tgt_rect->bottom < rect->bottom) {
+            *y1 = tgt_rect->bottom - rect->top;
+        }
+    }
+    return *x0 <= *x1 && *y0 <= *y1;
+}
 
 /*-----------------------------------------------------------------------*/
 /* Allocate a memory block from memory pool                              */
@@ -176,6 +215,117 @@ static void *alloc_pool(  /* Pointer to allocated memory block (NULL:no memory a
     return (void *)rp;  /* Return allocated memory block (NULL:no memory to allocate) */
 }
 
+/* Allocate a memory block aligned to 8 bytes for the objects holding pointers or 64-bit words */
+static void *alloc_pool_aligned(  /* Pointer to allocated memory block (NULL:no memory available) */
+    JDEC *jd,               /* Pointer to the decompressor object */
+    int32_t ndata            /* Number of bytes to allocate */
+)
+{
+    int32_t pad = (int32_t)(-(uintptr_t)jd->pool & 7);    /* Bytes up to the next 8-byte boundary */
+    char *rp;
+
+
+    rp = (char *)alloc_pool(jd, ndata + pad);
+
+    return rp ? (void *)(rp + pad) : NULL;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Load header bytes from the stream                                     */
+/*-----------------------------------------------------------------------*/
+/* The in-memory stream is not copied, *seg is pointed to the data in place.
+/  Returns number of bytes loaded at stream offset ofs (NULL seg: skip). */
+
+static int32_t jd_load(JDEC *jd, uint8_t **seg, uint32_t ofs, int32_t len)
+{
+    if (jd->mem) {
+        if (ofs > jd->szmem) {
+            return 0;
+        }
+        if ((uint32_t)len > jd->szmem - ofs) {
+            len = (int32_t)(jd->szmem - ofs);
+        }
+        if (seg) {
+            *seg = (uint8_t *)jd->mem + ofs;
+        }
+        return len;
+    }
+
+    if (!seg) {
+        return jd->infunc(jd, NULL, len);
+    }
+    *seg = jd->inbuf;
+    return jd->infunc(jd, jd->inbuf, len);
+}
+
+/* Input function of the in-memory stream. The decoder reads the stream in place, this serves
+/  the callers of jd->infunc (e.g. worker fallback) from its own read position. */
+static int32_t jd_mem_input(JDEC *jd, uint8_t *buf, int32_t len)
+{
+    uint32_t rest = jd->szmem - jd->mempos;
+
+    if (len <= 0) {
+        return 0;
+    }
+    if ((uint32_t)len > rest) {
+        len = (int32_t)rest;
+    }
+    if (buf) {
+        memcpy(buf, jd->mem + jd->mempos, (size_t)len);
+    }
+    jd->mempos += (uint32_t)len;    /* Read or skipped */
+
+    return len;
+}
+
+/* Seek function of the in-memory stream, moves the read position of jd_mem_input() */
+static int jd_mem_seek(JDEC *jd, uint32_t ofs)
+{
+    if (ofs > jd->szmem) {
+        return 0;
+    }
+    jd->mempos = ofs;
+
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Segment reader: a segment is loaded in parts of up to JD_SZBUF bytes  */
+/*-----------------------------------------------------------------------*/
+
+typedef struct {
+    JDEC *jd;
+    uint8_t *dp;            /* Next byte in the loaded part */
+    int32_t dc;             /* Bytes left in the loaded part */
+    int32_t len;            /* Bytes left in the segment */
+    uint32_t ofs;           /* Stream offset of the part to be loaded next */
+    bool err;               /* Input error */
+} JSEGRD;
+
+/* Get the next byte of the segment (the caller checks len, 0 on input error) */
+static uint8_t jd_seg_byte(JSEGRD *sr)
+{
+    int32_t n;
+
+    if (!sr->dc) {
+        n = sr->len;
+        if (!sr->jd->mem && n > JD_SZBUF) {  /* The in-memory segment is loaded at once */
+            n = JD_SZBUF;
+        }
+        if (n <= 0 || jd_load(sr->jd, &sr->dp, sr->ofs, n) != n) {
+            sr->err = true;
+            return 0;
+        }
+        JD_HEXDUMP(sr->dp, n);
+        sr->ofs += n;
+        sr->dc = n;
+    }
+    sr->dc--;
+    sr->len--;
+
+    return *sr->dp++;
+}
+
 /*-----------------------------------------------------------------------*/
 /* Create de-quantization and prescaling tables with a DQT segment       */
 /*-----------------------------------------------------------------------*/
@@ -183,8 +333,7 @@ static void *alloc_pool(  /* Pointer to allocated memory block (NULL:no memory a
 static JRESULT create_qt_tbl(  /* 0:OK, !0:Failed */
     JDEC *jd,               /* Pointer to the decompressor object */
     JTABLE *tbl,            /* Pointer to the table structure */
-    const uint8_t *data,    /* Pointer to the quantizer tables */
-    int32_t ndata            /* Size of input data */
+    JSEGRD *sr              /* Reader of the quantizer tables */
 )
 {
     unsigned int i, zi;
@@ -192,12 +341,11 @@ static JRESULT create_qt_tbl(  /* 0:OK, !0:Failed */
     int32_t *pb;
 
 
-    while (ndata) { /* Process all tables in the segment */
-        if (ndata < 65) {
+    while (sr->len) { /* Process all tables in the segment */
+        if (sr->len < 65) {
             return JDR_FMT1;    /* Err: table size is unaligned */
         }
-        ndata -= 65;
-        d = *data++;                            /* Get table property */
+        d = jd_seg_byte(sr);                    /* Get table property */
         if (d & 0xF0) {
             return JDR_FMT1;    /* Err: not 8-bit resolution */
         }
@@ -209,7 +357,10 @@ static JRESULT create_qt_tbl(  /* 0:OK, !0:Failed */
         tbl->qttbl[i] = pb;                      /* Register the table */
         for (i = 0; i < 64; i++) {              /* Load the table */
             zi = Zig[i];                        /* Zigzag-order to raster-order conversion */
-            pb[zi] = (int32_t)((uint32_t) * data++ * Ipsf[zi]); /* Apply scale factor of Arai algorithm to the de-quantizers */
+            pb[zi] = (int32_t)((uint32_t)jd_seg_byte(sr) * Ipsf[zi]); /* Apply scale factor of Arai algorithm to the de-quantizers */
+        }
+        if (sr->err) {
+            return JDR_INP;
         }
     }
 
@@ -226,8 +377,7 @@ static JRESULT create_qt_tbl(  /* 0:OK, !0:Failed */
 static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
     JDEC *jd,                   /* Pointer to the decompressor object */
     JTABLE *tbl,            /* Pointer to the table structure */
-    const uint8_t *data,        /* Pointer to the packed huffman tables */
-    int32_t ndata                /* Size of input data */
+    JSEGRD *sr                  /* Reader of the packed huffman tables */
 )
 {
     unsigned int i, j, b, cls, num;
@@ -236,12 +386,11 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
     uint16_t hc, *ph;
 
     /* header(1) | bits counter map (16) |  */
-    while (ndata) { /* Process all tables in the segment */
-        if (ndata < 17) {
+    while (sr->len) { /* Process all tables in the segment */
+        if (sr->len < 17) {
             return JDR_FMT1;    /* Err: wrong data size */
         }
-        ndata -= 17;
-        d = *data++;                        /* Get table number and class */
+        d = jd_seg_byte(sr);                /* Get table number and class */
         if (d & 0xEE) {
             return JDR_FMT1;    /* Err: invalid class/number */
         }
@@ -253,7 +402,10 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
         }
         tbl->huffbits[num][cls] = pb;
         for (np = i = 0; i < 16; i++) {     /* Load number of patterns for 1 to 16-bit code */
-            np += (pb[i] = *data++);        /* Get sum of code words for each code */
+            np += (pb[i] = jd_seg_byte(sr));    /* Get sum of code words for each code */
+        }
+        if (sr->err) {
+            return JDR_INP;
         }
         ph = alloc_pool(jd, np * sizeof(uint16_t)); /* Allocate a memory block for the code word table */
         if (!ph) {
@@ -269,10 +421,9 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
             hc <<= 1;
         }
 
-        if (ndata < np) {
+        if (sr->len < np) {
             return JDR_FMT1;    /* Err: wrong data size */
         }
-        ndata -= np;
         pd = alloc_pool(jd, np);            /* Allocate a memory block for the decoded data */
         if (!pd) {
             return JDR_MEM1;    /* Err: not enough memory */
@@ -280,7 +431,7 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
         tbl->huffdata[num][cls] = pd;
         if (cls == 0) {
             for (i = 0; i < np; i++) {          /* Load decoded data corresponds to each code word */
-                d = *data++;
+                d = jd_seg_byte(sr);
                 if (d > 11) {
                     return JDR_FMT1;
                 }
@@ -288,10 +439,13 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
             }
         } else {
             for (i = 0; i < np; i++) {          /* Load decoded data corresponds to each code word */
-                d = *data++;
+                d = jd_seg_byte(sr);
                 pd[i] = d;
             }
         }
+        if (sr->err) {
+            return JDR_INP;
+        }
 
 #if JD_FASTDECODE == 2
         {
@@ -299,20 +453,22 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
             unsigned int span, td, ti;
             uint16_t *tbl_ac = 0;
             uint8_t *tbl_dc = 0;
+            int32_t *mc;
+            int32_t *vp;
 
             if (cls) {
                 tbl_ac = alloc_pool(jd, HUFF_LEN * sizeof(uint16_t));   /* LUT for AC elements */
                 if (!tbl_ac) {
                     return JDR_MEM1;    /* Err: not enough memory */
                 }
-                jd->hufflut_ac[num] = tbl_ac;
+                tbl->hufflut_ac[num] = tbl_ac;
                 memset(tbl_ac, 0xFF, HUFF_LEN * sizeof(uint16_t));      /* Default value (0xFFFF: may be long code) */
             } else {
-                tbl_dc = alloc_pool(jd, HUFF_LEN * sizeof(uint8_t));    /* LUT for AC elements */
+                tbl_dc = alloc_pool(jd, HUFF_LEN * sizeof(uint8_t));    /* LUT for DC elements */
                 if (!tbl_dc) {
                     return JDR_MEM1;    /* Err: not enough memory */
                 }
-                jd->hufflut_dc[num] = tbl_dc;
+                tbl->hufflut_dc[num] = tbl_dc;
                 memset(tbl_dc, 0xFF, HUFF_LEN * sizeof(uint8_t));       /* Default value (0xFF: may be long code) */
             }
             for (i = b = 0; b < HUFF_BIT; b++) {    /* Create LUT */
@@ -327,7 +483,26 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
                     }
                 }
             }
-            jd->longofs[num][cls] = i;  /* Code table offset for long code */
+            tbl->longofs[num][cls] = i;  /* Code table offset for long code */
+
+            /* Create canonical decode table for long code (HUFF_BIT + 1 to 16-bit) */
+            mc = alloc_pool(jd, (16 - HUFF_BIT) * sizeof(int32_t));
+            vp = alloc_pool(jd, (16 - HUFF_BIT) * sizeof(int32_t));
+            if (!mc || !vp) {
+                return JDR_MEM1;    /* Err: not enough memory */
+            }
+            tbl->maxcode[num][cls] = mc;
+            tbl->valptr[num][cls] = vp;
+            for (b = HUFF_BIT; b < 16; b++) {
+                if (pb[b]) {
+                    vp[b - HUFF_BIT] = (int32_t)i - ph[i];    /* Index of the data = code word + valptr */
+                    i += pb[b];
+                    mc[b - HUFF_BIT] = ph[i - 1];               /* Last code word of this length */
+                } else {
+                    vp[b - HUFF_BIT] = 0;
+                    mc[b - HUFF_BIT] = -1;                      /* No code word of this length */
+                }
+            }
         }
 #endif
     }
@@ -341,7 +516,8 @@ static JRESULT create_huffman_tbl(  /* 0:OK, !0:Failed */
 
 static void block_idct(
     int32_t *src,   /* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
-    jd_yuv_t *dst   /* Pointer to the destination to store the block as byte array */
+    jd_yuv_t *dst,  /* Pointer to the destination to store the block as byte array */
+    int r0, int r1  /* Rows to be output (the others in dst are left as is) */
 )
 {
     const int32_t M13 = (int32_t)(1.41421 * 4096), M2 = (int32_t)(1.08239 * 4096), M4 = (int32_t)(2.61313 * 4096), M5 = (int32_t)(1.84776 * 4096);
@@ -396,8 +572,9 @@ static void block_idct(
     }
 
     /* Process rows */
-    src -= 8;
-    for (i = 0; i < 8; i++) {
+    src += 8 * r0 - 8;
+    dst += 8 * r0;
+    for (i = r0; i <= r1; i++) {
         v0 = src[0] + (128L << 8);  /* Get even elements (remove DC offset (-128) here) */
         v1 = src[2];
         v2 = src[4];
@@ -456,8 +633,451 @@ static void block_idct(
     }
 }
 
-int jd_get_hc(JHUFF *huff, uint32_t dreg, uint8_t dbit, uint8_t *val)
+#if !JD_SIMD_X86
+/* Whole block by block_idct, the kernel without SIMD */
+static void block_idct_full(int32_t *src, jd_yuv_t *dst)
+{
+    block_idct(src, dst, 0, 7);
+}
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Inverse-DCT of sparse blocks (same arithmetic as block_idct)          */
+/*-----------------------------------------------------------------------*/
+
+/* 1-D transform of 8 elements with the elements 4 to 7 being zero */
+static inline void idct_1d4(
+    int32_t *o,     /* Output 8 elements */
+    int32_t s0, int32_t s1, int32_t s2, int32_t s3
+)
+{
+    const int32_t M13 = (int32_t)(1.41421 * 4096), M2 = (int32_t)(1.08239 * 4096), M4 = (int32_t)(2.61313 * 4096), M5 = (int32_t)(1.84776 * 4096);
+    int32_t v1, v2, v3, v4, v5, v6, v7;
+    int32_t t11, t12, t13;
+
+    t11 = (s2 * M13 >> 12) - s2;    /* Process the even elements */
+    v1 = t11 + s0;
+    v2 = s0 - t11;
+    v3 = s0 - s2;
+    s0 += s2;
+
+    t12 = -s3;                      /* Process the odd elements */
+    v5 = (s1 - s3) * M13 >> 12;
+    v7 = s3 + s1;
+    t13 = (s1 + t12) * M5 >> 12;
+    v4 = t13 - (s1 * M2 >> 12);
+    v6 = t13 - (t12 * M4 >> 12) - v7;
+    v5 -= v6;
+    v4 -= v5;
+
+    o[0] = s0 + v7;
+    o[7] = s0 - v7;
+    o[1] = v1 + v6;
+    o[6] = v1 - v6;
+    o[2] = v2 + v5;
+    o[5] = v2 - v5;
+    o[3] = v3 + v4;
+    o[4] = v3 - v4;
+}
+
+/* Block which has non-zero elements only in the top-left n x n (n = 2 or 4) */
+static void block_idct_sparse(
+    int32_t *src,   /* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t *dst,  /* Pointer to the destination to store the block as byte array */
+    int n,          /* Size of the non-zero area */
+    int r0, int r1  /* Rows to be output (the others in dst are left as is) */
+)
+{
+    int32_t o[8];
+    int i, j;
+
+    /* Process columns (the columns n to 7 are all zero) */
+    for (i = 0; i < n; i++) {
+        idct_1d4(o, src[8 * 0 + i], src[8 * 1 + i], n > 2 ? src[8 * 2 + i] : 0, n > 2 ? src[8 * 3 + i] : 0);
+        for (j = 0; j < 8; j++) {
+            src[8 * j + i] = o[j];
+        }
+    }
+
+    /* Process rows */
+    src += 8 * r0;
+    dst += 8 * r0;
+    for (i = r0; i <= r1; i++) {
+        idct_1d4(o, src[0] + (128L << 8), src[1], n > 2 ? src[2] : 0, n > 2 ? src[3] : 0);    /* Remove DC offset (-128) here */
+
+        /* Descale the transformed values 8 bits and output a row */
+        for (j = 0; j < 8; j++) {
+#if JD_FASTDECODE >= 1
+            dst[j] = (int16_t)(o[j] >> 8);
+#else
+            dst[j] = BYTECLIP(o[j] >> 8);
+#endif
+        }
+
+        dst += 8;
+        src += 8; /* Next row */
+    }
+}
+
+#if JD_USE_SCALE
+/*-----------------------------------------------------------------------*/
+/* Reduced Inverse-DCT for scaled output (1/2, 1/4)                      */
+/*-----------------------------------------------------------------------*/
+/* The n-point transform of the low-frequency n elements samples the 8-point
+/  one at the centers of the n output pixels. The input is pre-scaled for
+/  Arai algorithm, so each constant is cos((2k+1)u*pi/2n) / cos(u*pi/16). */
+
+/* 1-D transform of n (2 or 4) elements */
+static inline void idct_1d_reduced(
+    int32_t *o,     /* Output n elements */
+    int32_t s0, int32_t s1, int32_t s2, int32_t s3,
+    int n
+)
+{
+    const int32_t K1 = (int32_t)(0.72096 * 4096);   /* 2-point */
+    const int32_t A1 = (int32_t)(0.94198 * 4096), B1 = (int32_t)(0.39018 * 4096);  /* 4-point */
+    const int32_t C2 = (int32_t)(0.76537 * 4096);
+    const int32_t A3 = (int32_t)(0.46024 * 4096), B3 = (int32_t)(1.11114 * 4096);
+    int32_t e0, e1, o0, o1;
+
+    if (n == 2) {
+        o0 = s1 * K1 >> 12;
+        o[0] = s0 + o0;
+        o[1] = s0 - o0;
+        return;
+    }
+
+    e1 = s2 * C2 >> 12;             /* Process the even elements */
+    e0 = s0 + e1;
+    e1 = s0 - e1;
+    o0 = (s1 * A1 >> 12) + (s3 * A3 >> 12);     /* Process the odd elements */
+    o1 = (s1 * B1 >> 12) - (s3 * B3 >> 12);
+    o[0] = e0 + o0;
+    o[3] = e0 - o0;
+    o[1] = e1 + o1;
+    o[2] = e1 - o1;
+}
+
+/* Block scaled down to n x n (n = 2 or 4) pixels in the top-left of dst */
+static void block_idct_reduced(
+    int32_t *src,   /* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t *dst,  /* Pointer to the destination to store the block as byte array */
+    int n           /* Size of the output block */
+)
+{
+    int32_t o[4];
+    int i, j;
+
+    /* Process columns */
+    for (i = 0; i < n; i++) {
+        idct_1d_reduced(o, src[8 * 0 + i], src[8 * 1 + i], n > 2 ? src[8 * 2 + i] : 0, n > 2 ? src[8 * 3 + i] : 0, n);
+        for (j = 0; j < n; j++) {
+            src[8 * j + i] = o[j];
+        }
+    }
+
+    /* Process rows */
+    for (i = 0; i < n; i++) {
+        idct_1d_reduced(o, src[0] + (128L << 8), src[1], n > 2 ? src[2] : 0, n > 2 ? src[3] : 0, n);   /* Remove DC offset (-128) here */
+
+        /* Descale the transformed values 8 bits and output a row */
+        for (j = 0; j < n; j++) {
+#if JD_FASTDECODE >= 1
+            dst[j] = (int16_t)(o[j] >> 8);
+#else
+            dst[j] = BYTECLIP(o[j] >> 8);
+#endif
+        }
+
+        dst += 8;
+        src += 8; /* Next row */
+    }
+}
+#endif
+
+#if JD_SIMD_X86
+/*-----------------------------------------------------------------------*/
+/* Apply Inverse-DCT in Arai Algorithm with SIMD (same as block_idct)    */
+/*-----------------------------------------------------------------------*/
+
+/* 1-D transform of the 8 elements e[0..7], a lane per column or row */
+#define JD_IDCT_VEC_FUNC(name, attr, vec_t, add, sub, mul) \
+static inline attr void name(vec_t *e) \
+{ \
+    const int32_t M13 = (int32_t)(1.41421 * 4096), M2 = (int32_t)(1.08239 * 4096), M4 = (int32_t)(2.61313 * 4096), M5 = (int32_t)(1.84776 * 4096); \
+    vec_t v0, v1, v2, v3, v4, v5, v6, v7; \
+    vec_t t10, t11, t12, t13; \
+ \
+    v0 = e[0];          /* Process the even elements */ \
+    v1 = e[2]; \
+    v2 = e[4]; \
+    v3 = e[6]; \
+    t10 = add(v0, v2); \
+    t12 = sub(v0, v2); \
+    t11 = mul(sub(v1, v3), M13); \
+    v3 = add(v3, v1); \
+    t11 = sub(t11, v3); \
+    v0 = add(t10, v3); \
+    v3 = sub(t10, v3); \
+    v1 = add(t11, t12); \
+    v2 = sub(t12, t11); \
+ \
+    v4 = e[7];          /* Process the odd elements */ \
+    v5 = e[1]; \
+    v6 = e[5]; \
+    v7 = e[3]; \
+    t10 = sub(v5, v4); \
+    t11 = add(v5, v4); \
+    t12 = sub(v6, v7); \
+    v7 = add(v7, v6); \
+    v5 = mul(sub(t11, v7), M13); \
+    v7 = add(v7, t11); \
+    t13 = mul(add(t10, t12), M5); \
+    v4 = sub(t13, mul(t10, M2)); \
+    v6 = sub(sub(t13, mul(t12, M4)), v7); \
+    v5 = sub(v5, v6); \
+    v4 = sub(v4, v5); \
+ \
+    e[0] = add(v0, v7); \
+    e[7] = sub(v0, v7); \
+    e[1] = add(v1, v6); \
+    e[6] = sub(v1, v6); \
+    e[2] = add(v2, v5); \
+    e[5] = sub(v2, v5); \
+    e[3] = add(v3, v4); \
+    e[4] = sub(v3, v4); \
+}
+
+/* SSE2: 4 lanes of int32 */
+static inline __m128i mul_sse2(__m128i a, int32_t m)
+{
+#if defined(__SSE4_1__)
+    return _mm_srai_epi32(_mm_mullo_epi32(a, _mm_set1_epi32(m)), 12);
+#else
+    __m128i b = _mm_set1_epi32(m);
+    __m128i t0 = _mm_mul_epu32(a, b);                                       /* Lane 0, 2 */
+    __m128i t1 = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));   /* Lane 1, 3 */
+
+    return _mm_srai_epi32(_mm_unpacklo_epi32(_mm_shuffle_epi32(t0, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(t1, _MM_SHUFFLE(0, 0, 2, 0))), 12);
+#endif
+}
+
+JD_IDCT_VEC_FUNC(idct_vec_sse2, , __m128i, _mm_add_epi32, _mm_sub_epi32, mul_sse2)
+
+/* Transpose 4x4 int32 */
+static inline void transpose_sse2(__m128i *r)
+{
+    __m128i a0, a1, a2, a3;
+
+    a0 = _mm_unpacklo_epi32(r[0], r[1]);
+    a1 = _mm_unpackhi_epi32(r[0], r[1]);
+    a2 = _mm_unpacklo_epi32(r[2], r[3]);
+    a3 = _mm_unpackhi_epi32(r[2], r[3]);
+    r[0] = _mm_unpacklo_epi64(a0, a2);
+    r[1] = _mm_unpackhi_epi64(a0, a2);
+    r[2] = _mm_unpacklo_epi64(a1, a3);
+    r[3] = _mm_unpackhi_epi64(a1, a3);
+}
+
+static void block_idct_sse2(
+    int32_t *src,   /* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t *dst   /* Pointer to the destination to store the block as byte array */
+)
+{
+    __m128i l[8], h[8], t[4];   /* Left (column 0-3) and right (column 4-7) halves */
+    __m128i a, b;
+    int i;
+
+    /* Process columns, a lane per column */
+    for (i = 0; i < 8; i++) {
+        l[i] = _mm_loadu_si128((const __m128i *)(src + 8 * i));
+        h[i] = _mm_loadu_si128((const __m128i *)(src + 8 * i + 4));
+    }
+    idct_vec_sse2(l);
+    idct_vec_sse2(h);
+
+    /* Process rows, a lane per row: l = row 0-3, h = row 4-7 after the transposition */
+    transpose_sse2(&l[0]);
+    transpose_sse2(&l[4]);
+    transpose_sse2(&h[0]);
+    transpose_sse2(&h[4]);
+    for (i = 0; i < 4; i++) {
+        t[i] = h[i];
+        h[i] = l[i + 4];
+        l[i + 4] = t[i];
+    }
+    l[0] = _mm_add_epi32(l[0], _mm_set1_epi32(128L << 8));  /* Remove DC offset (-128) here */
+    h[0] = _mm_add_epi32(h[0], _mm_set1_epi32(128L << 8));
+    idct_vec_sse2(l);
+    idct_vec_sse2(h);
+
+    /* Back to a row per vector: l = column 0-3, h = column 4-7 */
+    transpose_sse2(&l[0]);
+    transpose_sse2(&l[4]);
+    transpose_sse2(&h[0]);
+    transpose_sse2(&h[4]);
+    for (i = 0; i < 4; i++) {
+        t[i] = h[i];
+        h[i] = l[i + 4];
+        l[i + 4] = t[i];
+    }
+
+    /* Descale the transformed values 8 bits and output rows as int16_t (truncated, not saturated) */
+    for (i = 0; i < 8; i++) {
+        a = _mm_srai_epi32(_mm_slli_epi32(l[i], 8), 16);
+        b = _mm_srai_epi32(_mm_slli_epi32(h[i], 8), 16);
+        _mm_storeu_si128((__m128i *)(dst + 8 * i), _mm_packs_epi32(a, b));
+    }
+}
+
+#if JD_SIMD_AVX2
+/* AVX2: 8 lanes of int32, compiled for AVX2 regardless of the build target and used if the CPU has it */
+#define JD_AVX2     __attribute__((target("avx2")))
+
+static inline JD_AVX2 __m256i mul_avx2(__m256i a, int32_t m)
+{
+    return _mm256_srai_epi32(_mm256_mullo_epi32(a, _mm256_set1_epi32(m)), 12);
+}
+
+static inline JD_AVX2 __m256i add_avx2(__m256i a, __m256i b)
+{
+    return _mm256_add_epi32(a, b);
+}
+
+static inline JD_AVX2 __m256i sub_avx2(__m256i a, __m256i b)
+{
+    return _mm256_sub_epi32(a, b);
+}
+
+JD_IDCT_VEC_FUNC(idct_vec_avx2, JD_AVX2, __m256i, add_avx2, sub_avx2, mul_avx2)
+
+/* Transpose 8x8 int32 */
+static inline JD_AVX2 void transpose_avx2(__m256i *r)
+{
+    __m256i a0, a1, a2, a3, a4, a5, a6, a7, b0, b1, b2, b3, b4, b5, b6, b7;
+
+    a0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    a1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    a2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    a3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    a4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    a5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    a6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    a7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    b0 = _mm256_unpacklo_epi64(a0, a2);
+    b1 = _mm256_unpackhi_epi64(a0, a2);
+    b2 = _mm256_unpacklo_epi64(a1, a3);
+    b3 = _mm256_unpackhi_epi64(a1, a3);
+    b4 = _mm256_unpacklo_epi64(a4, a6);
+    b5 = _mm256_unpackhi_epi64(a4, a6);
+    b6 = _mm256_unpacklo_epi64(a5, a7);
+    b7 = _mm256_unpackhi_epi64(a5, a7);
+    r[0] = _mm256_permute2x128_si256(b0, b4, 0x20);
+    r[1] = _mm256_permute2x128_si256(b1, b5, 0x20);
+    r[2] = _mm256_permute2x128_si256(b2, b6, 0x20);
+    r[3] = _mm256_permute2x128_si256(b3, b7, 0x20);
+    r[4] = _mm256_permute2x128_si256(b0, b4, 0x31);
+    r[5] = _mm256_permute2x128_si256(b1, b5, 0x31);
+    r[6] = _mm256_permute2x128_si256(b2, b6, 0x31);
+    r[7] = _mm256_permute2x128_si256(b3, b7, 0x31);
+}
+
+static JD_AVX2 void block_idct_avx2(
+    int32_t *src,   /* Input block data (de-quantized and pre-scaled for Arai Algorithm) */
+    jd_yuv_t *dst   /* Pointer to the destination to store the block as byte array */
+)
+{
+    __m256i e[8];
+    __m256i a, b;
+    int i;
+
+    /* Process columns, a lane per column */
+    for (i = 0; i < 8; i++) {
+        e[i] = _mm256_loadu_si256((const __m256i *)(src + 8 * i));
+    }
+    idct_vec_avx2(e);
+
+    /* Process rows, a lane per row (remove DC offset (-128) here) */
+    transpose_avx2(e);
+    e[0] = _mm256_add_epi32(e[0], _mm256_set1_epi32(128L << 8));
+    idct_vec_avx2(e);
+    transpose_avx2(e);
+
+    /* Descale the transformed values 8 bits and output rows as int16_t (truncated, not saturated) */
+    for (i = 0; i < 8; i += 2) {
+        a = _mm256_srai_epi32(_mm256_slli_epi32(e[i], 8), 16);
+        b = _mm256_srai_epi32(_mm256_slli_epi32(e[i + 1], 8), 16);
+        a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i *)(dst + 8 * i), a);
+    }
+}
+#endif
+#endif
+
+/* Inverse-DCT kernel of a whole block for the CPU */
+static jd_idct_t jd_idct_kernel(void)
+{
+#if JD_SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return block_idct_avx2;
+    }
+#endif
+#if JD_SIMD_X86
+    return block_idct_sse2;
+#else
+    return block_idct_full;
+#endif
+}
+
+/*-----------------------------------------------------------------------*/
+/* Extract a huffman decoded data from the MSBs of the bit stream        */
+/*-----------------------------------------------------------------------*/
+
+int jd_get_hc(JHUFF *huff, uint8_t cls, uint32_t dreg, uint8_t dbit, uint8_t *val)
 {
+#if JD_FASTDECODE == 2
+    unsigned int d, bl;
+    int32_t code;
+
+    /* Short code: a single table lookup gives code length and zero run/data length */
+    d = dreg >> (32 - HUFF_BIT);
+    if (cls) {
+        d = ((uint16_t *)huff->hufflut)[d];
+        if (d != 0xFFFF) {
+            bl = d >> 8;
+            if (bl > dbit) {
+                return 0;
+            }
+            *val = (uint8_t)d;
+            return bl;
+        }
+    } else {
+        d = ((uint8_t *)huff->hufflut)[d];
+        if (d != 0xFF) {
+            bl = d >> 4;
+            if (bl > dbit) {
+                return 0;
+            }
+            *val = d & 0x0F;
+            return bl;
+        }
+    }
+
+    /* Long code: compare with the largest code word of each length */
+    for (bl = HUFF_BIT + 1; bl <= 16; bl++) {
+        code = (int32_t)(dreg >> (32 - bl));
+        if (code <= huff->maxcode[bl - HUFF_BIT - 1]) {
+            if (bl > dbit) {
+                return 0;
+            }
+            *val = huff->huffdata[huff->valptr[bl - HUFF_BIT - 1] + code];
+            return bl;
+        }
+    }
+
+    return 0;
+#else
     uint8_t i, n_codes;
     uint16_t n_bits;
 
@@ -483,6 +1103,7 @@ int jd_get_hc(JHUFF *huff, uint32_t dreg, uint8_t dbit, uint8_t *val)
     }
 
     return 0;
+#endif
 }
 
 // YUV → Grayscale (1 byte)
@@ -491,90 +1112,446 @@ void yuv_to_grayscale(uint8_t **pix, int yy, int cb, int cr)
     *(*pix)++ = (uint8_t)yy;  // Just use Y channel
 }
 
-// YUV → RGB888 (R, G, B)
-void yuv_to_rgb888(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → RGB888 (R, G, B)
+static inline void put_rgb888(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(*pix)++ = ycbcr2r(yy, cb, cr);
-    *(*pix)++ = ycbcr2g(yy, cb, cr);
-    *(*pix)++ = ycbcr2b(yy, cb, cr);
+    *(*pix)++ = r;
+    *(*pix)++ = g;
+    *(*pix)++ = b;
 }
 
-// YUV → BGR888 (B, G, R)
-void yuv_to_bgr888(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → BGR888 (B, G, R)
+static inline void put_bgr888(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(*pix)++ = ycbcr2b(yy, cb, cr);
-    *(*pix)++ = ycbcr2g(yy, cb, cr);
-    *(*pix)++ = ycbcr2r(yy, cb, cr);
+    *(*pix)++ = b;
+    *(*pix)++ = g;
+    *(*pix)++ = r;
 }
 
-// YUV → RGB565 (2 bytes)
-void yuv_to_rgb565(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → RGB565 (2 bytes)
+static inline void put_rgb565(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    uint8_t r = ycbcr2r(yy, cb, cr);
-    uint8_t g = ycbcr2g(yy, cb, cr);
-    uint8_t b = ycbcr2b(yy, cb, cr);
-
     uint16_t rgb = ((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3);
 
     *(*pix)++ = rgb & 0xFF;
     *(*pix)++ = (rgb >> 8) & 0xFF;
 }
 
-// YUV → BGR565 (2 bytes)
-void yuv_to_bgr565(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → BGR565 (2 bytes)
+static inline void put_bgr565(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    uint8_t r = ycbcr2r(yy, cb, cr);
-    uint8_t g = ycbcr2g(yy, cb, cr);
-    uint8_t b = ycbcr2b(yy, cb, cr);
-
     uint16_t bgr = ((b & 0xF8) << 8) | ((g & 0xFC) << 3) | (r >> 3);
 
     *(*pix)++ = bgr & 0xFF;
     *(*pix)++ = (bgr >> 8) & 0xFF;
 }
 
-// YUV → RGBA8888 (R, G, B, A)
-void yuv_to_rgba8888(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → RGBA8888 (R, G, B, A)
+static inline void put_rgba8888(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(*pix)++ = ycbcr2r(yy, cb, cr);
-    *(*pix)++ = ycbcr2g(yy, cb, cr);
-    *(*pix)++ = ycbcr2b(yy, cb, cr);
+    *(*pix)++ = r;
+    *(*pix)++ = g;
+    *(*pix)++ = b;
     *(*pix)++ = 0xFF;  // Alpha channel
 }
 
-// YUV → BGRA888 (B, G, R, A)
-void yuv_to_bgra8888(uint8_t **pix, int yy, int cb, int cr)
+// R, G, B → BGRA8888 (B, G, R, A)
+static inline void put_bgra8888(uint8_t **pix, uint8_t r, uint8_t g, uint8_t b)
 {
-    *(*pix)++ = ycbcr2b(yy, cb, cr);
-    *(*pix)++ = ycbcr2g(yy, cb, cr);
-    *(*pix)++ = ycbcr2r(yy, cb, cr);
+    *(*pix)++ = b;
+    *(*pix)++ = g;
+    *(*pix)++ = r;
     *(*pix)++ = 0xFF;  // Alpha channel
 }
 
-static const jd_yuv_fmt_t jd_yuv_fmt_tab[] = {
-    yuv_to_grayscale,
-    yuv_to_rgb565,
-    yuv_to_bgr565,
-    yuv_to_rgb888,
-    yuv_to_bgr888,
-    yuv_to_rgba8888,
-    yuv_to_bgra8888,
-};
+// YUV → RGB888 (R, G, B)
+void yuv_to_rgb888(uint8_t **pix, int yy, int cb, int cr)
+{
+    put_rgb888(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
 
-void yuv400_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+// YUV → BGR888 (B, G, R)
+void yuv_to_bgr888(uint8_t **pix, int yy, int cb, int cr)
 {
-    uint8_t *pix;
-    jd_yuv_t *py;
-    int yy, cb = 0, cr = 0;
+    put_bgr888(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
 
-    /* Build a RGB MCU from discrete comopnents */
-    pix = (uint8_t *)jd->workbuf;
-    py = jd->mcubuf;
-    for (unsigned int iy = 0; iy < 8; iy++) {
-        for (unsigned int ix = 0; ix < 8; ix++) {
-            yy = *py++;   /* Get Y component */
-            jd->yuv_fmt(&pix, yy, cb, cr);
-        }
+// YUV → RGB565 (2 bytes)
+void yuv_to_rgb565(uint8_t **pix, int yy, int cb, int cr)
+{
+    put_rgb565(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
+
+// YUV → BGR565 (2 bytes)
+void yuv_to_bgr565(uint8_t **pix, int yy, int cb, int cr)
+{
+    put_bgr565(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
+
+// YUV → RGBA8888 (R, G, B, A)
+void yuv_to_rgba8888(uint8_t **pix, int yy, int cb, int cr)
+{
+    put_rgba8888(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
+
+// YUV → BGRA888 (B, G, R, A)
+void yuv_to_bgra8888(uint8_t **pix, int yy, int cb, int cr)
+{
+    put_bgra8888(pix, ycbcr2r(yy, cb, cr), ycbcr2g(yy, cb, cr), ycbcr2b(yy, cb, cr));
+}
+
+static const jd_yuv_fmt_t jd_yuv_fmt_tab[] = {
+    yuv_to_grayscale,
+    yuv_to_rgb565,
+    yuv_to_bgr565,
+    yuv_to_rgb888,
+    yuv_to_bgr888,
+    yuv_to_rgba8888,
+    yuv_to_bgra8888,
+};
+
+static const uint8_t jd_color_bpp[] = {     /* Bytes per pixel of each JCOLOR */
+    1, 2, 2, 3, 3, 4, 4,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Convert a span of YCbCr samples to output pixels                      */
+/*-----------------------------------------------------------------------*/
+/* py: n Y samples, pcb/pcr: Cb/Cr samples (NULL: grayscale image),
+/  sh: 0 for a Cb/Cr sample per pixel, 1 for a Cb/Cr sample per 2 pixels */
+
+/* Convert the span pixel by pixel with the converter of the output format */
+static inline void yuv_row_c(uint8_t *pix, const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int n, int sh, jd_yuv_fmt_t fmt)
+{
+    int i;
+
+    if (!pcb) {
+        for (i = 0; i < n; i++) {
+            fmt(&pix, py[i], 0, 0);
+        }
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        fmt(&pix, py[i], pcb[i >> sh] - 128, pcr[i >> sh] - 128);
+    }
+}
+
+#if JD_SIMD_X86
+/* BYTECLIP() of 4 lanes of int32 */
+static inline __m128i byteclip_sse2(__m128i v)
+{
+#if JD_TBLCLIP
+    /* Same as the table: 0..255 as is, 256..511 to 255, 512..1023 to 0 (index masked to 10 bits) */
+    __m128i m1, m2;
+
+    v = _mm_and_si128(v, _mm_set1_epi32(0x3FF));
+    m1 = _mm_cmpgt_epi32(v, _mm_set1_epi32(255));
+    m2 = _mm_cmpgt_epi32(v, _mm_set1_epi32(511));
+    return _mm_or_si128(_mm_andnot_si128(m1, v), _mm_and_si128(_mm_andnot_si128(m2, m1), _mm_set1_epi32(255)));
+#else
+    return v;   /* Saturated by the packing */
+#endif
+}
+
+/* x / CVACC_COEF of 4 lanes of int32, rounded toward zero as the C division */
+static inline __m128i cvacc_div_sse2(__m128i x)
+{
+    return _mm_srai_epi32(_mm_add_epi32(x, _mm_and_si128(_mm_srai_epi32(x, 31), _mm_set1_epi32(CVACC_COEF - 1))), 10);
+}
+
+/* Convert 8 pixels to R, G, B (8 lanes of int16) with the same arithmetic as ycbcr2r/g/b */
+static inline void ycbcr2rgb_sse2(const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int sh, __m128i *r, __m128i *g, __m128i *b)
+{
+    const int KR = (int)(1.402 * CVACC_COEF), KGB = (int)(0.344 * CVACC_COEF), KGR = (int)(0.714 * CVACC_COEF), KB = (int)(1.772 * CVACC_COEF);
+    __m128i yv, cb, cr, y0, y1, t0, t1, zero = _mm_setzero_si128();
+
+    yv = _mm_loadu_si128((const __m128i *)py);
+    y0 = _mm_srai_epi32(_mm_unpacklo_epi16(yv, yv), 16);    /* Sign extension to int32 */
+    y1 = _mm_srai_epi32(_mm_unpackhi_epi16(yv, yv), 16);
+    if (!pcb) {
+        *r = *g = *b = _mm_packs_epi32(byteclip_sse2(y0), byteclip_sse2(y1));
+        return;
+    }
+    if (sh) {
+        cb = _mm_loadl_epi64((const __m128i *)pcb);
+        cr = _mm_loadl_epi64((const __m128i *)pcr);
+        cb = _mm_unpacklo_epi16(cb, cb);
+        cr = _mm_unpacklo_epi16(cr, cr);
+    } else {
+        cb = _mm_loadu_si128((const __m128i *)pcb);
+        cr = _mm_loadu_si128((const __m128i *)pcr);
+    }
+
+    /* R = Y + KR * (Cr - 128) / CVACC_COEF */
+    t0 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, zero), _mm_set1_epi32(KR)), _mm_set1_epi32(KR * 128));
+    t1 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, zero), _mm_set1_epi32(KR)), _mm_set1_epi32(KR * 128));
+    *r = _mm_packs_epi32(byteclip_sse2(_mm_add_epi32(y0, cvacc_div_sse2(t0))), byteclip_sse2(_mm_add_epi32(y1, cvacc_div_sse2(t1))));
+
+    /* G = Y - (KGB * (Cb - 128) + KGR * (Cr - 128)) / CVACC_COEF */
+    t0 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), _mm_set1_epi32(KGB | KGR << 16)), _mm_set1_epi32((KGB + KGR) * 128));
+    t1 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), _mm_set1_epi32(KGB | KGR << 16)), _mm_set1_epi32((KGB + KGR) * 128));
+    *g = _mm_packs_epi32(byteclip_sse2(_mm_sub_epi32(y0, cvacc_div_sse2(t0))), byteclip_sse2(_mm_sub_epi32(y1, cvacc_div_sse2(t1))));
+
+    /* B = Y + KB * (Cb - 128) / CVACC_COEF */
+    t0 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, zero), _mm_set1_epi32(KB)), _mm_set1_epi32(KB * 128));
+    t1 = _mm_sub_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, zero), _mm_set1_epi32(KB)), _mm_set1_epi32(KB * 128));
+    *b = _mm_packs_epi32(byteclip_sse2(_mm_add_epi32(y0, cvacc_div_sse2(t0))), byteclip_sse2(_mm_add_epi32(y1, cvacc_div_sse2(t1))));
+}
+
+/* Store 8 pixels of R, G, B (8 lanes of int16, saturated to 0..255 here), returns the next pixel */
+static inline uint8_t *rgb_store_sse2(uint8_t *pix, __m128i r, __m128i g, __m128i b, JCOLOR color)
+{
+    __m128i t0, t1, zero = _mm_setzero_si128();
+    uint32_t v;
+    int j;
+
+    r = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), zero);    /* Saturate to 0..255 */
+    g = _mm_unpacklo_epi8(_mm_packus_epi16(g, g), zero);
+    b = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), zero);
+    if (color == JD_BGR565 || color == JD_BGR888 || color == JD_BGRA8888) {
+        t0 = r;
+        r = b;
+        b = t0;
+    }
+    if (color == JD_RGB565 || color == JD_BGR565) {
+        t0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(r, _mm_set1_epi16(0xF8)), 8), _mm_slli_epi16(_mm_and_si128(g, _mm_set1_epi16(0xFC)), 3));
+        _mm_storeu_si128((__m128i *)pix, _mm_or_si128(t0, _mm_srli_epi16(b, 3)));
+        return pix + 16;
+    }
+    t0 = _mm_or_si128(r, _mm_slli_epi16(g, 8));             /* 1st and 2nd byte */
+    t1 = _mm_or_si128(b, _mm_set1_epi16((short)0xFF00));   /* 3rd byte and alpha */
+    if (color == JD_RGBA8888 || color == JD_BGRA8888) {
+        _mm_storeu_si128((__m128i *)pix, _mm_unpacklo_epi16(t0, t1));
+        _mm_storeu_si128((__m128i *)(pix + 16), _mm_unpackhi_epi16(t0, t1));
+        return pix + 32;
+    }
+    /* Drop the alpha with overlapping 32-bit stores, the last pixel is stored bytewise */
+    t0 = _mm_unpacklo_epi16(r = t0, t1);
+    t1 = _mm_unpackhi_epi16(r, t1);
+    for (j = 0; j < 4; j++) {
+        v = (uint32_t)_mm_cvtsi128_si32(t0);
+        memcpy(pix, &v, 4);
+        t0 = _mm_srli_si128(t0, 4);
+        pix += 3;
+    }
+    for (j = 0; j < 3; j++) {
+        v = (uint32_t)_mm_cvtsi128_si32(t1);
+        memcpy(pix, &v, 4);
+        t1 = _mm_srli_si128(t1, 4);
+        pix += 3;
+    }
+    v = (uint32_t)_mm_cvtsi128_si32(t1);
+    *pix++ = (uint8_t)v;
+    *pix++ = (uint8_t)(v >> 8);
+    *pix++ = (uint8_t)(v >> 16);
+    return pix;
+}
+
+/* Convert 8 pixels at a time, the rest of the span is done by yuv_row_c() */
+static inline void yuv_row_sse2(uint8_t *pix, const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int n, int sh, JCOLOR color, jd_yuv_fmt_t fmt)
+{
+    __m128i r, g, b, t0;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        if (color == JD_GRAYSCALE) {    /* Y as uint8_t */
+            t0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)(py + i)), _mm_set1_epi16(0xFF));
+            _mm_storel_epi64((__m128i *)pix, _mm_packus_epi16(t0, t0));
+            pix += 8;
+            continue;
+        }
+        ycbcr2rgb_sse2(py + i, pcb ? pcb + (i >> sh) : NULL, pcr ? pcr + (i >> sh) : NULL, sh, &r, &g, &b);
+        pix = rgb_store_sse2(pix, r, g, b, color);
+    }
+    yuv_row_c(pix, py + i, pcb ? pcb + (i >> sh) : NULL, pcr ? pcr + (i >> sh) : NULL, n - i, sh, fmt);
+}
+
+/* Y + chroma term of 8 pixels (a term per 2 pixels), clipped as BYTECLIP() */
+static inline __m128i term_add_sse2(__m128i y0, __m128i y1, const int16_t *ct, bool neg)
+{
+    __m128i t = _mm_loadl_epi64((const __m128i *)ct);
+
+    t = _mm_unpacklo_epi16(t, t);
+    if (neg) {
+        t = _mm_sub_epi16(_mm_setzero_si128(), t);
+    }
+    return _mm_packs_epi32(byteclip_sse2(_mm_add_epi32(y0, _mm_srai_epi32(_mm_unpacklo_epi16(t, t), 16))),
+                           byteclip_sse2(_mm_add_epi32(y1, _mm_srai_epi32(_mm_unpackhi_epi16(t, t), 16))));
+}
+
+/* Convert 8 pixels at a time with the chroma terms, returns the number of pixels done */
+static inline int term_row_sse2(uint8_t **pix, const jd_yuv_t *py, const int16_t *ct, int n, JCOLOR color)
+{
+    __m128i yv, y0, y1;
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        yv = _mm_loadu_si128((const __m128i *)(py + i));
+        y0 = _mm_srai_epi32(_mm_unpacklo_epi16(yv, yv), 16);    /* Sign extension to int32 */
+        y1 = _mm_srai_epi32(_mm_unpackhi_epi16(yv, yv), 16);
+        *pix = rgb_store_sse2(*pix, term_add_sse2(y0, y1, ct + (i >> 1), false),
+                              term_add_sse2(y0, y1, ct + 64 + (i >> 1), true),
+                              term_add_sse2(y0, y1, ct + 128 + (i >> 1), false), color);
+    }
+    return i;
+}
+
+#define JD_YUV_ROW_FUNC(name, color, fmt) \
+static inline void name(uint8_t *pix, const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int n, int sh) \
+{ \
+    yuv_row_sse2(pix, py, pcb, pcr, n, sh, color, fmt); \
+}
+#else
+#define JD_YUV_ROW_FUNC(name, color, fmt) \
+static inline void name(uint8_t *pix, const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int n, int sh) \
+{ \
+    yuv_row_c(pix, py, pcb, pcr, n, sh, fmt); \
+}
+#endif
+
+JD_YUV_ROW_FUNC(yuv_row_grayscale, JD_GRAYSCALE, yuv_to_grayscale)
+JD_YUV_ROW_FUNC(yuv_row_rgb565, JD_RGB565, yuv_to_rgb565)
+JD_YUV_ROW_FUNC(yuv_row_bgr565, JD_BGR565, yuv_to_bgr565)
+JD_YUV_ROW_FUNC(yuv_row_rgb888, JD_RGB888, yuv_to_rgb888)
+JD_YUV_ROW_FUNC(yuv_row_bgr888, JD_BGR888, yuv_to_bgr888)
+JD_YUV_ROW_FUNC(yuv_row_rgba8888, JD_RGBA8888, yuv_to_rgba8888)
+JD_YUV_ROW_FUNC(yuv_row_bgra8888, JD_BGRA8888, yuv_to_bgra8888)
+
+static const jd_yuv_row_t jd_yuv_row_tab[] = {
+    yuv_row_grayscale,
+    yuv_row_rgb565,
+    yuv_row_bgr565,
+    yuv_row_rgb888,
+    yuv_row_bgr888,
+    yuv_row_rgba8888,
+    yuv_row_bgra8888,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Convert a span of Y samples with the chroma terms (4:2:2, 4:2:0)      */
+/*-----------------------------------------------------------------------*/
+/* A Cb/Cr sample is shared by 2 or 4 pixels, so its contributions to R, G and B are
+/  computed once per MCU into jd->cterm and only added to each Y sample.
+/  ct: R, G, B term planes (64 each) at the sample of the first pixel, a term per 2 pixels */
+
+typedef void (*jd_term_row_t)(uint8_t *pix, const jd_yuv_t *py, const int16_t *ct, int n);
+
+/* R = Y + ct[0], G = Y - ct[64], B = Y + ct[128] with the arithmetic of ycbcr2r/g/b,
+/  for the samples in columns c0..c1 and rows r0..r1 of the Cb/Cr blocks */
+static void yuv_chroma_terms(int16_t *ct, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int c0, int c1, int r0, int r1)
+{
+    int i, j, cb, cr;
+
+    for (i = 8 * r0; i <= 8 * r1; i += 8) {
+        for (j = i + c0; j <= i + c1; j++) {
+            cb = pcb[j] - 128;
+            cr = pcr[j] - 128;
+            ct[j] = (int16_t)(((int)(1.402 * CVACC_COEF) * cr) / CVACC_COEF);
+            ct[64 + j] = (int16_t)(((int)(0.344 * CVACC_COEF) * cb + (int)(0.714 * CVACC_COEF) * cr) / CVACC_COEF);
+            ct[128 + j] = (int16_t)(((int)(1.772 * CVACC_COEF) * cb) / CVACC_COEF);
+        }
+    }
+}
+
+#if JD_SIMD_X86
+#define JD_TERM_ROW_SIMD(pix, py, ct, n, color)     term_row_sse2(pix, py, ct, n, color)
+#else
+#define JD_TERM_ROW_SIMD(pix, py, ct, n, color)     0
+#endif
+
+#define JD_TERM_ROW_FUNC(name, color, put) \
+static inline void name(uint8_t *pix, const jd_yuv_t *py, const int16_t *ct, int n) \
+{ \
+    int i, y; \
+    for (i = JD_TERM_ROW_SIMD(&pix, py, ct, n, color); i < n; i++) { \
+        y = py[i]; \
+        put(&pix, BYTECLIP(y + ct[i >> 1]), BYTECLIP(y - ct[64 + (i >> 1)]), BYTECLIP(y + ct[128 + (i >> 1)])); \
+    } \
+}
+
+JD_TERM_ROW_FUNC(term_row_rgb565, JD_RGB565, put_rgb565)
+JD_TERM_ROW_FUNC(term_row_bgr565, JD_BGR565, put_bgr565)
+JD_TERM_ROW_FUNC(term_row_rgb888, JD_RGB888, put_rgb888)
+JD_TERM_ROW_FUNC(term_row_bgr888, JD_BGR888, put_bgr888)
+JD_TERM_ROW_FUNC(term_row_rgba8888, JD_RGBA8888, put_rgba8888)
+JD_TERM_ROW_FUNC(term_row_bgra8888, JD_BGRA8888, put_bgra8888)
+
+static const jd_term_row_t jd_term_row_tab[] = {
+    NULL,   /* Grayscale output of Y/Cb/Cr is done by yuv_luma_scan() */
+    term_row_rgb565,
+    term_row_bgr565,
+    term_row_rgb888,
+    term_row_bgr888,
+    term_row_rgba8888,
+    term_row_bgra8888,
+};
+
+/*-----------------------------------------------------------------------*/
+/* Convert a Y block into the frame buffer, clipped to jd->fbrect        */
+/*-----------------------------------------------------------------------*/
+/* pcb/pcr: Cb/Cr blocks converted by row (4:4:4, NULL: grayscale),
+/  ct: chroma terms converted by trow instead (4:2:2, 4:2:0, NULL: not subsampled),
+/  (bx, by): Position of the Y block in the Cb/Cr block in unit of Y sample,
+/  vsh: Vertical subsampling shift of Cb/Cr */
+
+static inline void yuv_block_fb(JDEC *jd, jd_yuv_row_t row, jd_term_row_t trow, int bpp, const JRECT *rect,
+                                const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, const int16_t *ct, int bx, int by, int vsh)
+{
+    int x0, x1, y0, y1, y, ix, iy, n, cofs;
+    uint8_t *pix;
+
+    x0 = rect->left > jd->fbrect.left ? rect->left : jd->fbrect.left;
+    x1 = rect->right < jd->fbrect.right ? rect->right : jd->fbrect.right;
+    y0 = rect->top > jd->fbrect.top ? rect->top : jd->fbrect.top;
+    y1 = rect->bottom < jd->fbrect.bottom ? rect->bottom : jd->fbrect.bottom;
+    for (y = y0; y <= y1 && x0 <= x1; y++) {
+        pix = jd->fb + (y - jd->fbrect.top) * jd->fbstride + (x0 - jd->fbrect.left) * bpp;
+        ix = x0 - rect->left;
+        iy = y - rect->top;
+        n = x1 - x0 + 1;
+        if (!ct) {
+            row(pix, py + iy * 8 + ix, pcb ? pcb + iy * 8 + ix : NULL, pcr ? pcr + iy * 8 + ix : NULL, n, 0);
+            continue;
+        }
+        cofs = ((by + iy) >> vsh) * 8;
+        if ((bx + ix) & 1) {    /* Align the span to the Cb/Cr sample */
+            trow(pix, py + iy * 8 + ix, ct + cofs + ((bx + ix) >> 1), 1);
+            pix += bpp;
+            ix++;
+            n--;
+        }
+        if (n > 0) {
+            trow(pix, py + iy * 8 + ix, ct + cofs + ((bx + ix) >> 1), n);
+        }
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Convert an MCU to output pixels and pass them to the output function  */
+/*-----------------------------------------------------------------------*/
+/* row: span converter, bpp: bytes per pixel. A block is bs x bs pixels (8 >> jd->scale)
+/  in the top-left of its 8 x 8 buffer, rectangles are in the scaled image.
+/  With jd->fb, the pixels are written into the frame buffer instead. */
+
+static inline void yuv400_scan_body(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect, jd_yuv_row_t row, int bpp)
+{
+    int bs = 8 >> jd->scale;
+    int x0, x1, y0, y1;
+    uint8_t *pix;
+    jd_yuv_t *py;
+
+    /* Build a RGB MCU from discrete comopnents */
+    pix = (uint8_t *)jd->workbuf;
+    py = jd->mcubuf;
+    if (jd->fb) {
+        yuv_block_fb(jd, row, NULL, bpp, mcu_rect, py, NULL, NULL, NULL, 0, 0, 0);
+        return;
+    }
+    if (!jd_block_span(mcu_rect, tgt_rect, &x0, &x1, &y0, &y1)) {
+        return;
+    }
+    for (int iy = y0; iy <= y1; iy++) {     /* Pixels out of the rectangle are left undefined */
+        row(pix + (iy * bs + x0) * bpp, py + iy * 8 + x0, NULL, NULL, x1 - x0 + 1, 0);
     }
 
     jd->outfunc(jd, jd->workbuf, mcu_rect);
@@ -584,25 +1561,29 @@ void yuv400_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
     // JD_RGBDUMP(pix, 3 * 64);
 }
 
-void yuv444_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+static inline void yuv444_scan_body(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect, jd_yuv_row_t row, int bpp)
 {
+    int bs = 8 >> jd->scale;
+    int x0, x1, y0, y1, ofs;
     uint8_t *pix = (uint8_t *)jd->workbuf;
     jd_yuv_t *py, *pcb, *pcr;
-    int yy, cb, cr;
 
     /* In YUV444, each pixel has its own Y, Cb, Cr values */
     py  = jd->mcubuf;        // Y block start
     pcb = py + 64;           // Cb block start
     pcr = pcb + 64;          // Cr block start
 
-    for (unsigned int iy = 0; iy < 8; iy++) {
-        for (unsigned int ix = 0; ix < 8; ix++) {
-            yy = *py++;
-            cb = *pcb++ - 128;
-            cr = *pcr++ - 128;
+    if (jd->fb) {
+        yuv_block_fb(jd, row, NULL, bpp, mcu_rect, py, pcb, pcr, NULL, 0, 0, 0);
+        return;
+    }
 
-            jd->yuv_fmt(&pix, yy, cb, cr);
-        }
+    if (!jd_block_span(mcu_rect, tgt_rect, &x0, &x1, &y0, &y1)) {
+        return;
+    }
+    for (int iy = y0; iy <= y1; iy++) {     /* Pixels out of the rectangle are left undefined */
+        ofs = iy * 8 + x0;
+        row(pix + (iy * bs + x0) * bpp, py + ofs, pcb + ofs, pcr + ofs, x1 - x0 + 1, 0);
     }
 
     /* output */
@@ -613,21 +1594,24 @@ void yuv444_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
     // JD_RGBDUMP(pix, 3 * 64);
 }
 
-
-void yuv422_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+static inline void yuv422_scan_body(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect, jd_term_row_t trow, int bpp)
 {
-    int iy, ix, icmp;
+    int bs = 8 >> jd->scale;
+    int iy, icmp, x0, x1, y0, y1;
     jd_yuv_t *py, *pcb, *pcr;
     uint8_t *pix = (uint8_t *)jd->workbuf;
 
     int y_block_col, y_block_row;
-    int yy, cb, cr;
 
     JRECT rect;
 
     // 4 blocks: Y1, Y2, Cb, Cr → 16x8 Y region
     pcb = jd->mcubuf + 64 * 2;   // Cb block starts after Y1 + Y2
     pcr = pcb + 64;              // Cr block starts after Cb
+    if (!jd_block_span(mcu_rect, tgt_rect, &x0, &x1, &y0, &y1)) {
+        return;
+    }
+    yuv_chroma_terms(jd->cterm, pcb, pcr, x0 >> 1, x1 >> 1, y0, y1);  // Shared by both Y blocks
 
     // Loop through the two Y blocks (icmp = 0: left, 1: right)
     for (icmp = 0; icmp < 2; icmp++) {
@@ -635,32 +1619,31 @@ void yuv422_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
         pix = (uint8_t *)jd->workbuf;
 
         // Block positions: 0=(0,0), 1=(8,0)
-        y_block_col = (icmp & 1) << 3;  // 0 or 8
+        y_block_col = (icmp & 1) * bs;  // 0 or 8 (scaled)
         y_block_row = 0;                // Only one row of Y blocks
 
         rect.left = mcu_rect->left + y_block_col;
         rect.top = mcu_rect->top + y_block_row;
-        rect.right = rect.left + 8 - 1;
-        rect.bottom = rect.top + 8 - 1;
+        rect.right = rect.left + bs - 1;
+        rect.bottom = rect.top + bs - 1;
 
-        if ((tgt_rect != NULL) && !is_rect_intersect(&rect, tgt_rect)) {
+        if (!jd_block_span(&rect, tgt_rect, &x0, &x1, &y0, &y1)) {
             continue;   // Skip this block if it does not intersect with the target rectangle
         }
 
-        for (iy = 0; iy < 8; iy++) {
-            for (ix = 0; ix < 8; ix++) {
-                int x_abs = y_block_col + ix;
-                int y_abs = y_block_row + iy;
+        if (jd->fb) {
+            yuv_block_fb(jd, NULL, trow, bpp, &rect, py, NULL, NULL, jd->cterm, y_block_col, y_block_row, 0);
+            continue;
+        }
 
-                // Cb/Cr sampled at 2:1 horizontally, 1:1 vertically → 8x8 UV blocks
-                int uv_idx = (y_abs << 3) + (x_abs >> 1);
+        x0 &= ~1;   // Start at a Cb/Cr sample, pixels out of the rectangle are left undefined
+        for (iy = y0; iy <= y1; iy++) {
+            int y_abs = y_block_row + iy;
 
-                yy = *py++;
-                cb = pcb[uv_idx] - 128;
-                cr = pcr[uv_idx] - 128;
+            // Cb/Cr sampled at 2:1 horizontally, 1:1 vertically → 8x8 UV blocks
+            int uv_idx = (y_abs << 3) + ((y_block_col + x0) >> 1);
 
-                jd->yuv_fmt(&pix, yy, cb, cr);
-            }
+            trow(pix + (iy * bs + x0) * bpp, py + iy * 8 + x0, jd->cterm + uv_idx, x1 - x0 + 1);
         }
 
         jd->outfunc(jd, jd->workbuf, &rect);
@@ -671,50 +1654,53 @@ void yuv422_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
     }
 }
 
-void yuv420_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+static inline void yuv420_scan_body(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect, jd_term_row_t trow, int bpp)
 {
-    int iy, ix, icmp;
+    int bs = 8 >> jd->scale;
+    int iy, icmp, x0, x1, y0, y1;
     jd_yuv_t *py, *pcb, *pcr;
     uint8_t *pix = (uint8_t *)jd->workbuf;
 
     int y_block_col, y_block_row;
-    int yy, cb, cr;
 
     JRECT rect;
 
     // 6 blocks: Y1,Y2,Y3,Y4,Cb,Cr
     pcb = jd->mcubuf + 64 * 4;     // Cb block起点
     pcr = pcb + 64;                // Cr block起点
+    if (!jd_block_span(mcu_rect, tgt_rect, &x0, &x1, &y0, &y1)) {
+        return;
+    }
+    yuv_chroma_terms(jd->cterm, pcb, pcr, x0 >> 1, x1 >> 1, y0 >> 1, y1 >> 1);    // Shared by the four Y blocks
 
     for (icmp = 0; icmp < 4; icmp++) {
         py = jd->mcubuf + icmp * 64;
         pix = (uint8_t *)jd->workbuf;
 
-        // 0: (0, 0), 1: (8, 0), 2: (0, 8), 3: (8, 8)
-        y_block_col = (icmp & 1) << 3;
-        y_block_row = (icmp >> 1) << 3;
+        // 0: (0, 0), 1: (8, 0), 2: (0, 8), 3: (8, 8) (scaled)
+        y_block_col = (icmp & 1) * bs;
+        y_block_row = (icmp >> 1) * bs;
 
         rect.left = mcu_rect->left + y_block_col;
         rect.top = mcu_rect->top + y_block_row;
-        rect.right = rect.left + 8 - 1;
-        rect.bottom = rect.top + 8 - 1;
+        rect.right = rect.left + bs - 1;
+        rect.bottom = rect.top + bs - 1;
 
-        if ((tgt_rect != NULL) && !is_rect_intersect(&rect, tgt_rect)) {
+        if (!jd_block_span(&rect, tgt_rect, &x0, &x1, &y0, &y1)) {
             continue;   // Skip this block if it does not intersect with the target rectangle
         }
 
-        for (iy = 0; iy < 8; iy++) {
-            for (ix = 0; ix < 8; ix++) {
-                int x_abs = y_block_col + ix;
-                int y_abs = y_block_row + iy;
-                int uv_idx = ((y_abs >> 1) << 3) + (x_abs >> 1);    // y/2 * 8 + x/2
+        if (jd->fb) {
+            yuv_block_fb(jd, NULL, trow, bpp, &rect, py, NULL, NULL, jd->cterm, y_block_col, y_block_row, 1);
+            continue;
+        }
 
-                yy = *py++;
-                cb = pcb[uv_idx] - 128;
-                cr = pcr[uv_idx] - 128;
+        x0 &= ~1;   // Start at a Cb/Cr sample, pixels out of the rectangle are left undefined
+        for (iy = y0; iy <= y1; iy++) {
+            int y_abs = y_block_row + iy;
+            int uv_idx = ((y_abs >> 1) << 3) + ((y_block_col + x0) >> 1);  // y/2 * 8 + x/2
 
-                jd->yuv_fmt(&pix, yy, cb, cr);
-            }
+            trow(pix + (iy * bs + x0) * bpp, py + iy * 8 + x0, jd->cterm + uv_idx, x1 - x0 + 1);
         }
 
         jd->outfunc(jd, jd->workbuf, &rect);
@@ -725,196 +1711,808 @@ void yuv420_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
     }
 }
 
-JRESULT jd_output(JDEC *jd, uint8_t n_cmp, JRECT *mcu_rect, JRECT *tgt_rect)
+/* Grayscale output of a Y/Cb/Cr image: only the Y blocks of the MCU are transformed and output */
+static void yuv_luma_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
 {
-    int cmp, i;
-    JCOMP *component;
-    jd_yuv_t *p;
-    int32_t *tmp = (int32_t *)jd->workbuf;
+    int bs = 8 >> jd->scale;
+    int iy, iblk, x0, x1, y0, y1;
+    jd_yuv_t *py;
+    uint8_t *pix;
+    JRECT rect;
 
-    /* dequantize && idct */
-    for (cmp = 0; cmp < n_cmp; cmp++) {
-        component = &jd->component[cmp];
-        p = &jd->mcubuf[cmp << 6];      // cmp * 64
-        JD_LOG("Component %d:", cmp);
-        for (i = 0; i < 64; i++) {
-            if (p[i]) {
-                tmp[i] = p[i] * component->qttbl[i] >> 8;
-            } else {
-                tmp[i] = 0;
-            }
+    for (iblk = 0; iblk < jd->msx * jd->msy; iblk++) {
+        py = jd->mcubuf + iblk * 64;
+        pix = (uint8_t *)jd->workbuf;
+
+        rect.left = mcu_rect->left + (iblk % jd->msx) * bs;
+        rect.top = mcu_rect->top + (iblk / jd->msx) * bs;
+        rect.right = rect.left + bs - 1;
+        rect.bottom = rect.top + bs - 1;
+
+        if (!jd_block_span(&rect, tgt_rect, &x0, &x1, &y0, &y1)) {
+            continue;
         }
-        JD_LOG("TMP:");
-        JD_INTDUMP(tmp, 64);
-        block_idct(tmp, p);
-        JD_LOG("  P:");
-        JD_INTDUMP(p, 64);
-    }
 
-    /* scan & output */
-    jd->yuv_scan(jd, mcu_rect, tgt_rect);
+        if (jd->fb) {
+            yuv_block_fb(jd, yuv_row_grayscale, NULL, 1, &rect, py, NULL, NULL, NULL, 0, 0, 0);
+            continue;
+        }
 
-    return JDR_OK;
+        for (iy = y0; iy <= y1; iy++) {     /* Pixels out of the rectangle are left undefined */
+            yuv_row_grayscale(pix + iy * bs + x0, py + iy * 8 + x0, NULL, NULL, x1 - x0 + 1, 0);
+        }
+
+        jd->outfunc(jd, jd->workbuf, &rect);
+    }
 }
 
-/*-------------------------------------------------------------------------*/
-// API
-JRESULT jd_prepare(
-    JDEC *jd,               /* Blank decompressor object */
-    jd_infunc_t infunc,     /* JPEG strem input function */
-    void *pool,             /* Working buffer for the decompression session */
-    int32_t sz_pool,        /* Size of working buffer */
-    void *dev               /* I/O device identifier for the session */
-)
+/* Generic kernels, convert via jd->yuv_row (4:2:2, 4:2:0: the term converter of jd->color) */
+void yuv400_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
 {
-    uint8_t *seg, b;
-    uint16_t marker;
-    unsigned int n, i, ofs;
-    int32_t ret, len;
-    JRESULT rc;
+    yuv400_scan_body(jd, mcu_rect, tgt_rect, jd->yuv_row, jd_color_bpp[jd->color]);
+}
 
-    JTABLE _tbl, *tbl = &_tbl;
+void yuv444_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+{
+    yuv444_scan_body(jd, mcu_rect, tgt_rect, jd->yuv_row, jd_color_bpp[jd->color]);
+}
 
-    memset(tbl, 0, sizeof(JTABLE));
+void yuv422_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+{
+    yuv422_scan_body(jd, mcu_rect, tgt_rect, jd_term_row_tab[jd->color], jd_color_bpp[jd->color]);
+}
 
-    memset(jd, 0, sizeof(JDEC));    /* Clear decompression object (this might be a problem if machine's null pointer is not all bits zero) */
-    jd->pool = pool;        /* Work memroy */
-    jd->sz_pool = sz_pool;  /* Size of given work memory */
-    jd->infunc = infunc;    /* Stream input function */
-    jd->device = dev;       /* I/O device identifier */
+void yuv420_scan(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect)
+{
+    yuv420_scan_body(jd, mcu_rect, tgt_rect, jd_term_row_tab[jd->color], jd_color_bpp[jd->color]);
+}
 
-    jd->inbuf = seg = alloc_pool(jd, JD_SZBUF);     /* Allocate stream input buffer */
-    if (!seg) {
-        return JDR_MEM1;
-    }
+/* Specialized kernels of a sampling and output format, the span converter is inlined
+/  (grayscale output of Y/Cb/Cr is done by yuv_luma_scan()) */
+#define JD_SCAN_FUNCS_400(fmt, bpp) \
+static void yuv400_scan_##fmt(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect) \
+{ \
+    yuv400_scan_body(jd, mcu_rect, tgt_rect, yuv_row_##fmt, bpp); \
+}
+#define JD_SCAN_FUNCS(fmt, bpp) \
+JD_SCAN_FUNCS_400(fmt, bpp) \
+static void yuv444_scan_##fmt(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect) \
+{ \
+    yuv444_scan_body(jd, mcu_rect, tgt_rect, yuv_row_##fmt, bpp); \
+} \
+static void yuv422_scan_##fmt(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect) \
+{ \
+    yuv422_scan_body(jd, mcu_rect, tgt_rect, term_row_##fmt, bpp); \
+} \
+static void yuv420_scan_##fmt(JDEC *jd, JRECT *mcu_rect, JRECT *tgt_rect) \
+{ \
+    yuv420_scan_body(jd, mcu_rect, tgt_rect, term_row_##fmt, bpp); \
+}
 
-    ofs = marker = 0;       /* Find SOI marker */
-    do {
-        ret = jd->infunc(jd, seg, 1);
-        if (ret != 1) {
-            JD_LOG("ret %d", ret);
-            return JDR_INP;    /* Err: SOI was not detected */
-        }
-        ofs++;
-        marker = marker << 8 | seg[0];
-    } while (marker != 0xFFD8);
+#if JD_SCAN_COLORS & 0x01
+JD_SCAN_FUNCS_400(grayscale, 1)
+#define JD_SCAN_GRAYSCALE(s)    yuv##s##_scan_grayscale
+#else
+#define JD_SCAN_GRAYSCALE(s)    NULL
+#endif
+#if JD_SCAN_COLORS & 0x02
+JD_SCAN_FUNCS(rgb565, 2)
+#define JD_SCAN_RGB565(s)       yuv##s##_scan_rgb565
+#else
+#define JD_SCAN_RGB565(s)       NULL
+#endif
+#if JD_SCAN_COLORS & 0x04
+JD_SCAN_FUNCS(bgr565, 2)
+#define JD_SCAN_BGR565(s)       yuv##s##_scan_bgr565
+#else
+#define JD_SCAN_BGR565(s)       NULL
+#endif
+#if JD_SCAN_COLORS & 0x08
+JD_SCAN_FUNCS(rgb888, 3)
+#define JD_SCAN_RGB888(s)       yuv##s##_scan_rgb888
+#else
+#define JD_SCAN_RGB888(s)       NULL
+#endif
+#if JD_SCAN_COLORS & 0x10
+JD_SCAN_FUNCS(bgr888, 3)
+#define JD_SCAN_BGR888(s)       yuv##s##_scan_bgr888
+#else
+#define JD_SCAN_BGR888(s)       NULL
+#endif
+#if JD_SCAN_COLORS & 0x20
+JD_SCAN_FUNCS(rgba8888, 4)
+#define JD_SCAN_RGBA8888(s)     yuv##s##_scan_rgba8888
+#else
+#define JD_SCAN_RGBA8888(s)     NULL
+#endif
+#if JD_SCAN_COLORS & 0x40
+JD_SCAN_FUNCS(bgra8888, 4)
+#define JD_SCAN_BGRA8888(s)     yuv##s##_scan_bgra8888
+#else
+#define JD_SCAN_BGRA8888(s)     NULL
+#endif
 
-    for (;;) {              /* Parse JPEG segments */
-        JD_LOG("\n---");
+#define JD_SCAN_TAB_ROW(s, gray)  { \
+    gray, JD_SCAN_RGB565(s), JD_SCAN_BGR565(s), JD_SCAN_RGB888(s), \
+    JD_SCAN_BGR888(s), JD_SCAN_RGBA8888(s), JD_SCAN_BGRA8888(s) \
+}
 
-        /* Get a JPEG marker */
-        if (jd->infunc(jd, seg, 4) != 4) {
-            return JDR_INP;
-        }
+static const jd_yuv_scan_t jd_yuv_scan_tab[4][7] = {   /* [sampling][JCOLOR], NULL: not compiled in */
+    JD_SCAN_TAB_ROW(400, JD_SCAN_GRAYSCALE(400)),
+    JD_SCAN_TAB_ROW(444, NULL),
+    JD_SCAN_TAB_ROW(422, NULL),
+    JD_SCAN_TAB_ROW(420, NULL),
+};
 
-        marker = LDB_WORD(seg);     /* Marker */
-        if ((marker >> 8) != 0xFF) {
-            return JDR_FMT1;
-        }
-        marker = marker & 0xFF;
+static const jd_yuv_scan_t jd_yuv_scan_gen[4] = {       /* [sampling] */
+    yuv400_scan,
+    yuv444_scan,
+    yuv422_scan,
+    yuv420_scan,
+};
 
-        len = LDB_WORD(seg + 2);    /* Length field */
-        if (len <= 2) {
-            return JDR_FMT1;
+/*-----------------------------------------------------------------------*/
+/* Check if the output needs only the Y component of a Y/Cb/Cr image    */
+/*-----------------------------------------------------------------------*/
+
+static inline bool jd_luma_only(JDEC *jd)
+{
+    return jd->ncomp == 3 && jd->color == JD_GRAYSCALE && !jd->coeffunc;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Select the IDCT kernel for the CPU and the conversion kernels for the */
+/* sampling and output format                                            */
+/*-----------------------------------------------------------------------*/
+
+static void jd_select_kernel(JDEC *jd)
+{
+    int samp;
+
+    if (jd->ncomp == 1) {
+        samp = 0;           /* Grayscale */
+    } else if (jd->msx == 1) {
+        samp = 1;           /* 4:4:4 */
+    } else if (jd->msy == 1) {
+        samp = 2;           /* 4:2:2 */
+    } else {
+        samp = 3;           /* 4:2:0 */
+    }
+
+    jd->idct = jd_idct_kernel();
+    jd->yuv_fmt = jd_yuv_fmt_tab[jd->color];
+    jd->yuv_row = jd_yuv_row_tab[jd->color];
+    jd->yuv_scan = jd_yuv_scan_tab[samp][jd->color];
+    if (!jd->yuv_scan) {
+        jd->yuv_scan = jd_yuv_scan_gen[samp];
+    }
+    if (jd_luma_only(jd)) {
+        jd->yuv_scan = yuv_luma_scan;   /* Cb/Cr blocks are not transformed */
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Double-buffered input: the next block is read while the current one   */
+/* is decoded                                                            */
+/*-----------------------------------------------------------------------*/
+/* The device is ahead of inpos by the bytes being read (busy) or read but
+/  not used yet (ready). The input function is called only when idle. */
+
+typedef struct {
+    jd_startfunc_t start;   /* Start reading into buf */
+    jd_waitfunc_t wait;     /* Wait for the read to complete */
+    uint8_t *buf;           /* Buffer being filled, swapped with inbuf */
+    int32_t ready;          /* Bytes read in buf and not used yet */
+    bool busy;              /* A read is in progress */
+} JPREFETCH;
+
+/* Complete the read in progress, its bytes are kept ready */
+static void jd_prefetch_sync(JDEC *jd, JPREFETCH *pf)
+{
+    if (pf->busy) {
+        pf->ready = pf->wait(jd);
+        pf->busy = false;
+    }
+}
+
+/* Switch to the prefetched buffer and start reading the next one (0: no more data) */
+static int32_t jd_prefetch_next(JDEC *jd)
+{
+    JPREFETCH *pf = (JPREFETCH *)jd->prefetch;
+    uint8_t *buf;
+    int32_t n;
+
+    if (!pf->busy && !pf->ready) {
+        pf->start(jd, pf->buf, JD_SZBUF);
+        pf->busy = true;
+    }
+    jd_prefetch_sync(jd, pf);
+    n = pf->ready;
+    pf->ready = 0;
+    if (n <= 0) {
+        return 0;
+    }
+    buf = jd->inbuf;
+    jd->inbuf = pf->buf;
+    pf->buf = buf;
+    jd->inpos += n;
+    pf->start(jd, pf->buf, JD_SZBUF);
+    pf->busy = true;
+
+    return n;
+}
+
+/* Wait for the prefetch and drop it, returns how far the device is ahead of inpos */
+static int32_t jd_prefetch_drop(JDEC *jd)
+{
+    JPREFETCH *pf = (JPREFETCH *)jd->prefetch;
+    int32_t n;
+
+    if (!pf) {
+        return 0;
+    }
+    jd_prefetch_sync(jd, pf);
+    n = pf->ready > 0 ? pf->ready : 0;
+    pf->ready = 0;
+
+    return n;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Move the stream read pointer to the given stream offset               */
+/*-----------------------------------------------------------------------*/
+
+static JRESULT jd_seek(JDEC *jd, uint32_t ofs)
+{
+    uint32_t blk;
+    int32_t n;
+
+    if (jd->mem) {          /* In-memory stream is seeked by the pointer */
+        if (ofs > jd->szmem) {
+            return JDR_INP;
         }
-        len -= 2;           /* Segent content size */
-        ofs += 4 + len;     /* Number of bytes loaded */
+        jd->dptr = (uint8_t *)jd->mem + ofs;
+        jd->dctr = (int32_t)(jd->szmem - ofs);
+        return JDR_OK;
+    }
 
-        switch (marker) {
-        case 0xC0:  /* SOF0 (baseline JPEG) */
-        case 0xC4:
-        case 0xDA:
-        case 0xDB:
-        case 0xDD:
-            if (len > JD_SZBUF) {
-                JD_LOG("Insufficient buffer size %d > %d", len, JD_SZBUF);
-                return JDR_MEM2;
+    if (ofs <= jd->inpos && ofs >= jd->inpos - jd->dctr) {   /* Target is in the input buffer */
+        jd->dptr += jd->dctr - (int32_t)(jd->inpos - ofs);
+        jd->dctr = (int32_t)(jd->inpos - ofs);
+        return JDR_OK;
+    }
+
+    if (jd->prefetch) {
+        /* Target is in the prefetched block */
+        JPREFETCH *pf = (JPREFETCH *)jd->prefetch;
+
+        jd_prefetch_sync(jd, pf);
+        if (ofs >= jd->inpos && pf->ready > 0 && ofs < jd->inpos + pf->ready) {
+            n = jd_prefetch_next(jd);
+            jd->dptr = jd->inbuf + n - (int32_t)(jd->inpos - ofs);
+            jd->dctr = (int32_t)(jd->inpos - ofs);
+            return JDR_OK;
+        }
+    }
+
+    blk = ofs - ofs % JD_SZBUF;     /* Keep stream reads aligned to JD_SZBUF */
+    n = (int32_t)(blk - jd->inpos) - jd_prefetch_drop(jd);
+    if (n < 0) {            /* Behind the device, only the seek function can go back */
+        if (!jd->seekfunc) {
+            return JDR_PAR;
+        }
+        if (!jd->seekfunc(jd, blk)) {
+            return JDR_INP;
+        }
+    } else if (n && jd->infunc(jd, NULL, n) != n) {
+        return JDR_INP;
+    }
+    jd->inpos = blk;    /* Consistent even if the read below fails */
+    jd->dctr = 0;
+    n = jd->infunc(jd, jd->inbuf, JD_SZBUF);
+    jd->inpos = blk + n;
+    if (n < (int32_t)(ofs - blk)) {
+        return JDR_INP;
+    }
+    jd->dptr = jd->inbuf + (ofs - blk);
+    jd->dctr = n - (int32_t)(ofs - blk);
+    if (jd->prefetch && n == JD_SZBUF) {
+        /* Read the next block while this one is decoded */
+        JPREFETCH *pf = (JPREFETCH *)jd->prefetch;
+
+        pf->start(jd, pf->buf, JD_SZBUF);
+        pf->busy = true;
+    }
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Size of the scaled image                                              */
+/*-----------------------------------------------------------------------*/
+
+static inline uint16_t jd_scaled(JDEC *jd, uint16_t v)
+{
+    return (v + (1 << jd->scale) - 1) >> jd->scale;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Map a rectangle in the scaled image to the full size image            */
+/*-----------------------------------------------------------------------*/
+
+static JRECT *jd_unscale_rect(JDEC *jd, const JRECT *rect, JRECT *buf)
+{
+    uint32_t s = jd->scale, m = (1 << s) - 1;
+
+    if (!rect || !s) {
+        return (JRECT *)rect;
+    }
+    buf->left = ((uint32_t)rect->left << s) > 0xFFFF ? 0xFFFF : rect->left << s;
+    buf->top = ((uint32_t)rect->top << s) > 0xFFFF ? 0xFFFF : rect->top << s;
+    buf->right = (((uint32_t)rect->right << s) | m) > 0xFFFF ? 0xFFFF : (rect->right << s) | m;
+    buf->bottom = (((uint32_t)rect->bottom << s) | m) > 0xFFFF ? 0xFFFF : (rect->bottom << s) | m;
+
+    return buf;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get number of MCUs in the image                                       */
+/*-----------------------------------------------------------------------*/
+
+static uint32_t jd_mcu_count(JDEC *jd)
+{
+    uint32_t mw = jd->msx << 3, mh = jd->msy << 3;
+
+    return ((jd->width + mw - 1) / mw) * ((jd->height + mh - 1) / mh);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get index of the first MCU from imcu which intersects the rectangle   */
+/*-----------------------------------------------------------------------*/
+
+static uint32_t jd_first_mcu(JDEC *jd, const JRECT *rect, uint32_t imcu)
+{
+    uint32_t mw = jd->msx << 3, mh = jd->msy << 3;
+    uint32_t nmx = (jd->width + mw - 1) / mw, nmy = (jd->height + mh - 1) / mh;
+    uint32_t mx0, mx1, my1, r, c;
+
+    if (rect == NULL) {
+        return imcu;
+    }
+
+    mx0 = rect->left / mw;
+    mx1 = rect->right / mw;
+    my1 = rect->bottom / mh;
+    if (mx0 >= nmx) {
+        return nmx * nmy;   /* Rectangle is out of the image */
+    }
+
+    r = imcu / nmx;
+    c = imcu % nmx;
+    if (r < rect->top / mh) {
+        r = rect->top / mh;
+        c = mx0;
+    } else if (c < mx0) {
+        c = mx0;
+    } else if (c > mx1) {
+        r++;
+        c = mx0;
+    }
+    if (r > my1 || r >= nmy) {
+        return nmx * nmy;   /* No more MCU to be decoded */
+    }
+
+    return r * nmx + c;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get index of the last MCU which intersects the rectangle              */
+/*-----------------------------------------------------------------------*/
+
+static uint32_t jd_last_mcu(JDEC *jd, const JRECT *rect)
+{
+    uint32_t mw = jd->msx << 3, mh = jd->msy << 3;
+    uint32_t nmx = (jd->width + mw - 1) / mw, nmy = (jd->height + mh - 1) / mh;
+    uint32_t mx1, my1;
+
+    if (rect == NULL) {
+        return nmx * nmy - 1;
+    }
+
+    mx1 = rect->right / mw;
+    my1 = rect->bottom / mh;
+    if (mx1 >= nmx) {
+        mx1 = nmx - 1;
+    }
+    if (my1 >= nmy) {
+        my1 = nmy - 1;
+    }
+
+    return my1 * nmx + mx1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Get index of the first MCU from imcu to be decoded                    */
+/*-----------------------------------------------------------------------*/
+/* With jd->region, the first one intersecting any of the regions */
+
+static uint32_t jd_next_mcu(JDEC *jd, const JRECT *rect, uint32_t imcu)
+{
+    uint32_t i, n, first;
+    JRECT full;
+
+    if (!jd->region) {
+        return jd_first_mcu(jd, rect, imcu);
+    }
+    first = jd_mcu_count(jd);
+    for (i = 0; i < jd->nregion; i++) {
+        n = jd_first_mcu(jd, jd_unscale_rect(jd, &jd->region[i].rect, &full), imcu);
+        if (n < first) {
+            first = n;
+        }
+    }
+
+    return first;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Check if the MCU at (x, y) is out of the rectangle                    */
+/*-----------------------------------------------------------------------*/
+
+static inline bool is_mcu_skipped(JDEC *jd, const JRECT *rect, int x, int y)
+{
+    JRECT mcu;
+    unsigned int i;
+
+    if (rect == NULL) {
+        return false;
+    }
+    if (x > rect->right || x + (jd->msx << 3) - 1 < rect->left) {
+        return true;
+    }
+    if (y > rect->bottom || y + (jd->msy << 3) - 1 < rect->top) {
+        return true;
+    }
+    if (jd->region) {
+        /* rect is the bounding box, check each region in the scaled image */
+        mcu.left = x >> jd->scale;
+        mcu.top = y >> jd->scale;
+        mcu.right = (x + (jd->msx << 3) - 1) >> jd->scale;
+        mcu.bottom = (y + (jd->msy << 3) - 1) >> jd->scale;
+        for (i = 0; i < jd->nregion; i++) {
+            if (is_rect_intersect(&mcu, &jd->region[i].rect)) {
+                return false;
             }
-            if (jd->infunc(jd, seg, len) != len) {
-                return JDR_INP;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Convert an MCU into each region it intersects                         */
+/*-----------------------------------------------------------------------*/
+
+static void jd_output_regions(JDEC *jd, JRECT *mcu_rect)
+{
+    JREGION *rg;
+    uint16_t r = jd_scaled(jd, jd->width) - 1, b = jd_scaled(jd, jd->height) - 1;
+
+    for (jd->iregion = 0; jd->iregion < jd->nregion; jd->iregion++) {
+        rg = &jd->region[jd->iregion];
+        if (!is_rect_intersect(mcu_rect, &rg->rect)) {
+            continue;
+        }
+        if (rg->outfunc) {
+            jd->fb = NULL;
+            jd->outfunc = rg->outfunc;
+        } else {
+            /* buf is the top-left of the region clipped to the image */
+            jd->fb = (uint8_t *)rg->buf;
+            jd->fbstride = rg->stride;
+            jd->fbrect = rg->rect;
+            if (jd->fbrect.right > r) {
+                jd->fbrect.right = r;
+            }
+            if (jd->fbrect.bottom > b) {
+                jd->fbrect.bottom = b;
             }
+        }
+        jd->yuv_scan(jd, mcu_rect, &rg->rect);
+    }
+}
 
-            JD_LOG("Process segment marker %02X,%d:", marker, len);
-            JD_HEXDUMP(seg, len);
-            switch (marker) {
-            case 0xC0:  /* SOF0 (baseline JPEG) */
-                jd->width = LDB_WORD(&seg[3]);      /* Image width in unit of pixel */
-                jd->height = LDB_WORD(&seg[1]);     /* Image height in unit of pixel */
-                jd->ncomp = seg[5];                 /* Number of color components */
-                if (jd->ncomp != 3 && jd->ncomp != 1) {
-                    return JDR_FMT3;    /* Err: Supports only Grayscale and Y/Cb/Cr */
-                }
+/*-----------------------------------------------------------------------*/
+/* Get the rows of a block in the target rectangle (1/1 scale)           */
+/*-----------------------------------------------------------------------*/
+/* cmp: Block index in the MCU, r0/r1: First/last row of the block to be output.
+/  Returns false if no pixel of the block is in the rectangle. */
 
-                /* Check each image component */
-                for (i = 0; i < jd->ncomp; i++) {
-                    b = seg[7 + 3 * i];                         /* Get sampling factor */
-                    if (i == 0) {   /* Y component */
-                        /**/
-                        if (b != 0x11 && b != 0x22 && b != 0x21) {  /* Check sampling factor */
-                            return JDR_FMT3;                    /* Err: Supports only 4:4:4, 4:2:0 or 4:2:2 */
-                        }
-                        jd->msx = b >> 4;
-                        jd->msy = b & 15;     /* Size of MCU [blocks] */
-                    } else {        /* Cb/Cr component */
-                        if (b != 0x11) {
-                            return JDR_FMT3;    /* Err: Sampling factor of Cb/Cr must be 1 */
-                        }
-                    }
-                    tbl->qtid[i] = seg[8 + 3 * i];               /* Get dequantizer table ID for this component */
-                    if (tbl->qtid[i] > 3) {
-                        return JDR_FMT3;    /* Err: Invalid ID */
-                    }
-                }
+static inline bool jd_block_rows(JDEC *jd, int cmp, const JRECT *mcu_rect, const JRECT *tgt_rect, int *r0, int *r1)
+{
+    int x0, x1, sh = 0;
+    JRECT rect;
 
-                JD_LOG("SOF0 start of frame, w: %u, h: %u, ncomp: %u, msx: %u, msy: %u, qtid:", jd->width, jd->height, jd->ncomp, jd->msx, jd->msy);
-                JD_HEXDUMP(tbl->qtid, jd->ncomp);
-                break;
+    if (cmp < jd->msx * jd->msy) {
+        /* Y block */
+        rect.left = mcu_rect->left + (cmp % jd->msx) * 8;
+        rect.top = mcu_rect->top + (cmp / jd->msx) * 8;
+        rect.right = rect.left + 7;
+        rect.bottom = rect.top + 7;
+    } else {
+        /* Cb/Cr block covers the MCU */
+        rect = *mcu_rect;
+        sh = jd->msy - 1;
+    }
+    if (!jd_block_span(&rect, tgt_rect, &x0, &x1, r0, r1)) {
+        return false;
+    }
+    *r0 >>= sh;
+    *r1 >>= sh;
 
-            case 0xDD:  /* DRI - Define Restart Interval */
-                jd->nrst = LDB_WORD(seg);   /* Get restart interval (MCUs) */
-                JD_LOG("DRI define restart interval: %u", jd->nrst);
-                break;
+    return true;
+}
 
-            case 0xC4:  /* DHT - Define Huffman Tables */
-                JD_LOG("DHT define huffman tables:");
-                rc = create_huffman_tbl(jd, tbl, seg, len);  /* Create huffman tables */
-                if (rc) {
-                    return rc;
-                }
-                break;
+JRESULT jd_output(JDEC *jd, uint8_t n_cmp, JRECT *mcu_rect, JRECT *tgt_rect)
+{
+    int cmp, i, j, n, eob, r0, r1, bs = 8 >> jd->scale;
+    int32_t v;
+    JCOMP *component;
+    jd_yuv_t *p;
+    int32_t *tmp = (int32_t *)jd->workbuf;
+    JRECT srect, stgt;
 
-            case 0xDB:  /* DQT - Define Quaitizer Tables */
-                JD_LOG("DQT define quantizer tables:");
-                rc = create_qt_tbl(jd, tbl, seg, len);   /* Create de-quantizer tables */
-                if (rc) {
-                    return rc;
+    /* dequantize && idct */
+    for (cmp = 0; cmp < n_cmp; cmp++) {
+        component = &jd->component[cmp];
+        p = &jd->mcubuf[cmp << 6];      // cmp * 64
+        eob = jd->eobidx[cmp];
+        JD_LOG("Component %d: eob %u", cmp, eob);
+        r0 = 0;
+        r1 = 7;
+        if (tgt_rect && bs == 8 && !jd_block_rows(jd, cmp, mcu_rect, tgt_rect, &r0, &r1)) {
+            continue;   /* Not output (the blocks straddling the rectangle are transformed in part) */
+        }
+        if (eob == 0 || bs == 1) {
+            /* DC only: the block is flat (1/8 scale: the DC is the pixel) */
+            v = (p[0] * component->qttbl[0] >> 8) + (128L << 8);
+#if JD_FASTDECODE >= 1
+            v = (int16_t)(v >> 8);
+#else
+            v = BYTECLIP(v >> 8);
+#endif
+            for (i = 0; i < 8 * bs; i += 8) {
+                for (j = 0; j < bs; j++) {
+                    p[i + j] = (jd_yuv_t)v;
                 }
-                break;
-
-            case 0xDA:  /* SOS - Start of Scan */
-                JD_LOG("SOS start of scan:");
-                if (!jd->width || !jd->height) {
-                    return JDR_FMT1;    /* Err: Invalid image size */
+            }
+            JD_LOG("  P:");
+            JD_INTDUMP(p, 64);
+            continue;
+        }
+#if JD_USE_SCALE
+        if (bs < 8) {
+            /* Scaled output: only the top-left bs x bs elements are used */
+            for (i = 0; i < 8 * bs; i += 8) {
+                for (j = 0; j < bs; j++) {
+                    tmp[i + j] = p[i + j] * component->qttbl[i + j] >> 8;
                 }
-                if (seg[0] != jd->ncomp) {
-                    return JDR_FMT3;    /* Err: Wrong color components */
+            }
+            JD_LOG("TMP:");
+            JD_INTDUMP(tmp, 64);
+            block_idct_reduced(tmp, p, bs);
+            JD_LOG("  P:");
+            JD_INTDUMP(p, 64);
+            continue;
+        }
+#endif
+        n = eob <= 2 ? 2 : eob <= 9 ? 4 : 8;    /* Zigzag index 0-2 are in the top-left 2x2, 0-9 are in the 4x4 */
+        if (n < 8) {
+            for (i = 0; i < 8 * n; i += 8) {
+                for (j = 0; j < n; j++) {
+                    tmp[i + j] = p[i + j] * component->qttbl[i + j] >> 8;
                 }
-
-                /* Check if all tables corresponding to each components have been loaded */
-                for (i = 0; i < jd->ncomp; i++) {
-                    b = seg[2 + 2 * i]; /* Get huffman table ID */
-                    if (b != 0x00 && b != 0x11) {
-                        return JDR_FMT3;    /* Err: Different table number for DC/AC element */
-                    }
-                    n = i ? 1 : 0;                          /* Component class */
-                    if (!tbl->huffbits[n][0] || !tbl->huffbits[n][1]) {   /* Check huffman table for this component */
-                        return JDR_FMT1;                    /* Err: Nnot loaded */
-                    }
-                    if (!tbl->qttbl[tbl->qtid[i]]) {          /* Check dequantizer table for this component */
-                        return JDR_FMT1;                    /* Err: Not loaded */
-                    }
+            }
+            JD_LOG("TMP:");
+            JD_INTDUMP(tmp, 64);
+            block_idct_sparse(tmp, p, n, r0, r1);
+        } else {
+            for (i = 0; i < 64; i++) {
+                if (p[i]) {
+                    tmp[i] = p[i] * component->qttbl[i] >> 8;
+                } else {
+                    tmp[i] = 0;
                 }
-
+            }
+            JD_LOG("TMP:");
+            JD_INTDUMP(tmp, 64);
+#if JD_SIMD_X86
+            if (r1 - r0 < 2) {
+                block_idct(tmp, p, r0, r1);     /* One or two rows at the rectangle edge: cheaper without SIMD */
+            } else {
+                jd->idct(tmp, p);               /* All rows at once by the kernel for the CPU */
+            }
+#else
+            block_idct(tmp, p, r0, r1);
+#endif
+        }
+        JD_LOG("  P:");
+        JD_INTDUMP(p, 64);
+    }
+
+    if (jd->scale) {
+        /* Rectangles in the scaled image */
+        srect.left = mcu_rect->left >> jd->scale;
+        srect.top = mcu_rect->top >> jd->scale;
+        srect.right = mcu_rect->right >> jd->scale;
+        srect.bottom = mcu_rect->bottom >> jd->scale;
+        mcu_rect = &srect;
+        if (tgt_rect) {
+            stgt.left = tgt_rect->left >> jd->scale;
+            stgt.top = tgt_rect->top >> jd->scale;
+            stgt.right = tgt_rect->right >> jd->scale;
+            stgt.bottom = tgt_rect->bottom >> jd->scale;
+            tgt_rect = &stgt;
+        }
+    }
+
+    /* scan & output */
+    if (jd->region) {
+        jd_output_regions(jd, mcu_rect);
+    } else {
+        jd->yuv_scan(jd, mcu_rect, tgt_rect);
+    }
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Parse the JPEG headers up to the SOS segment                          */
+/*-----------------------------------------------------------------------*/
+
+static JRESULT jd_parse(JDEC *jd)
+{
+    uint8_t *seg, b;
+    uint16_t marker;
+    unsigned int n, i, ofs;
+    int32_t ret, len;
+    JSEGRD sr;
+    JRESULT rc;
+
+    JTABLE _tbl, *tbl = &_tbl;
+
+    memset(tbl, 0, sizeof(JTABLE));
+
+    ofs = marker = 0;       /* Find SOI marker */
+    do {
+        ret = jd_load(jd, &seg, ofs, 1);
+        if (ret != 1) {
+            JD_LOG("ret %d", ret);
+            return JDR_INP;    /* Err: SOI was not detected */
+        }
+        ofs++;
+        marker = marker << 8 | seg[0];
+    } while (marker != 0xFFD8);
+
+    for (;;) {              /* Parse JPEG segments */
+        JD_LOG("\n---");
+
+        /* Get a JPEG marker */
+        if (jd_load(jd, &seg, ofs, 4) != 4) {
+            return JDR_INP;
+        }
+
+        marker = LDB_WORD(seg);     /* Marker */
+        if ((marker >> 8) != 0xFF) {
+            return JDR_FMT1;
+        }
+        marker = marker & 0xFF;
+
+        len = LDB_WORD(seg + 2);    /* Length field */
+        if (len <= 2) {
+            return JDR_FMT1;
+        }
+        len -= 2;           /* Segent content size */
+        ofs += 4 + len;     /* Number of bytes loaded */
+
+        switch (marker) {
+        case 0xC4:  /* DHT - Define Huffman Tables */
+        case 0xDB:  /* DQT - Define Quaitizer Tables */
+            /* The tables are read in parts, the segment may be larger than the input buffer */
+            JD_LOG("Process segment marker %02X,%d:", marker, len);
+            sr.jd = jd;
+            sr.dc = 0;
+            sr.len = len;
+            sr.ofs = ofs - len;
+            sr.err = false;
+            if (marker == 0xC4) {
+                JD_LOG("DHT define huffman tables:");
+                rc = create_huffman_tbl(jd, tbl, &sr);  /* Create huffman tables */
+            } else {
+                JD_LOG("DQT define quantizer tables:");
+                rc = create_qt_tbl(jd, tbl, &sr);       /* Create de-quantizer tables */
+            }
+            if (rc) {
+                return rc;
+            }
+            break;
+
+        case 0xC0:  /* SOF0 (baseline JPEG) */
+        case 0xDA:
+        case 0xDD:
+            if (!jd->mem && len > JD_SZBUF) {
+                JD_LOG("Insufficient buffer size %d > %d", len, JD_SZBUF);
+                return JDR_MEM2;
+            }
+            if (jd_load(jd, &seg, ofs - len, len) != len) {
+                return JDR_INP;
+            }
+
+            JD_LOG("Process segment marker %02X,%d:", marker, len);
+            JD_HEXDUMP(seg, len);
+            switch (marker) {
+            case 0xC0:  /* SOF0 (baseline JPEG) */
+                jd->width = LDB_WORD(&seg[3]);      /* Image width in unit of pixel */
+                jd->height = LDB_WORD(&seg[1]);     /* Image height in unit of pixel */
+                jd->ncomp = seg[5];                 /* Number of color components */
+                if (jd->ncomp != 3 && jd->ncomp != 1) {
+                    return JDR_FMT3;    /* Err: Supports only Grayscale and Y/Cb/Cr */
+                }
+
+                /* Check each image component */
+                for (i = 0; i < jd->ncomp; i++) {
+                    b = seg[7 + 3 * i];                         /* Get sampling factor */
+                    if (i == 0) {   /* Y component */
+                        /**/
+                        if (b != 0x11 && b != 0x22 && b != 0x21) {  /* Check sampling factor */
+                            return JDR_FMT3;                    /* Err: Supports only 4:4:4, 4:2:0 or 4:2:2 */
+                        }
+                        jd->msx = b >> 4;
+                        jd->msy = b & 15;     /* Size of MCU [blocks] */
+                    } else {        /* Cb/Cr component */
+                        if (b != 0x11) {
+                            return JDR_FMT3;    /* Err: Sampling factor of Cb/Cr must be 1 */
+                        }
+                    }
+                    tbl->qtid[i] = seg[8 + 3 * i];               /* Get dequantizer table ID for this component */
+                    if (tbl->qtid[i] > 3) {
+                        return JDR_FMT3;    /* Err: Invalid ID */
+                    }
+                }
+
+                JD_LOG("SOF0 start of frame, w: %u, h: %u, ncomp: %u, msx: %u, msy: %u, qtid:", jd->width, jd->height, jd->ncomp, jd->msx, jd->msy);
+                JD_HEXDUMP(tbl->qtid, jd->ncomp);
+                break;
+
+            case 0xDD:  /* DRI - Define Restart Interval */
+                jd->nrst = LDB_WORD(seg);   /* Get restart interval (MCUs) */
+                JD_LOG("DRI define restart interval: %u", jd->nrst);
+                break;
+
+            case 0xDA:  /* SOS - Start of Scan */
+                JD_LOG("SOS start of scan:");
+                if (!jd->width || !jd->height) {
+                    return JDR_FMT1;    /* Err: Invalid image size */
+                }
+                if (seg[0] != jd->ncomp) {
+                    return JDR_FMT3;    /* Err: Wrong color components */
+                }
+
+                /* Check if all tables corresponding to each components have been loaded */
+                for (i = 0; i < jd->ncomp; i++) {
+                    b = seg[2 + 2 * i]; /* Get huffman table ID */
+                    if (b != 0x00 && b != 0x11) {
+                        return JDR_FMT3;    /* Err: Different table number for DC/AC element */
+                    }
+                    n = i ? 1 : 0;                          /* Component class */
+                    if (!tbl->huffbits[n][0] || !tbl->huffbits[n][1]) {   /* Check huffman table for this component */
+                        return JDR_FMT1;                    /* Err: Nnot loaded */
+                    }
+                    if (!tbl->qttbl[tbl->qtid[i]]) {          /* Check dequantizer table for this component */
+                        return JDR_FMT1;                    /* Err: Not loaded */
+                    }
+                }
+
                 /* Allocate working buffer for MCU and pixel output */
                 n = jd->msy * jd->msx;                      /* Number of Y blocks in the MCU */
                 if (!n) {
@@ -929,305 +2527,2041 @@ JRESULT jd_prepare(
                     jd->component[i].huff[1].huffbits = tbl->huffbits[0][1];
                     jd->component[i].huff[1].huffcode = tbl->huffcode[0][1];
                     jd->component[i].huff[1].huffdata = tbl->huffdata[0][1];
+#if JD_FASTDECODE == 2
+                    jd->component[i].huff[0].hufflut = tbl->hufflut_dc[0];
+                    jd->component[i].huff[0].maxcode = tbl->maxcode[0][0];
+                    jd->component[i].huff[0].valptr = tbl->valptr[0][0];
+                    jd->component[i].huff[1].hufflut = tbl->hufflut_ac[0];
+                    jd->component[i].huff[1].maxcode = tbl->maxcode[0][1];
+                    jd->component[i].huff[1].valptr = tbl->valptr[0][1];
+#endif
                     jd->component[i].qttbl = tbl->qttbl[tbl->qtid[0]];
+                    jd->component[i].qtid = tbl->qtid[0];
                     jd->component[i].dcv = &jd->dcv[0];
 
-                    JD_LOG("huff[%d]", i);
-                }
+                    JD_LOG("huff[%d]", i);
+                }
+
+                /* CrCb */
+                if (jd->ncomp == 3) {
+                    for (i = 0; i < 2; i++) {
+                        jd->component[n + i].huff[0].huffbits = tbl->huffbits[1][0];
+                        jd->component[n + i].huff[0].huffcode = tbl->huffcode[1][0];
+                        jd->component[n + i].huff[0].huffdata = tbl->huffdata[1][0];
+                        jd->component[n + i].huff[1].huffbits = tbl->huffbits[1][1];
+                        jd->component[n + i].huff[1].huffcode = tbl->huffcode[1][1];
+                        jd->component[n + i].huff[1].huffdata = tbl->huffdata[1][1];
+#if JD_FASTDECODE == 2
+                        jd->component[n + i].huff[0].hufflut = tbl->hufflut_dc[1];
+                        jd->component[n + i].huff[0].maxcode = tbl->maxcode[1][0];
+                        jd->component[n + i].huff[0].valptr = tbl->valptr[1][0];
+                        jd->component[n + i].huff[1].hufflut = tbl->hufflut_ac[1];
+                        jd->component[n + i].huff[1].maxcode = tbl->maxcode[1][1];
+                        jd->component[n + i].huff[1].valptr = tbl->valptr[1][1];
+#endif
+                        jd->component[n + i].qttbl = tbl->qttbl[tbl->qtid[i + 1]];
+                        jd->component[n + i].qtid = tbl->qtid[i + 1];
+                        jd->component[n + i].dcv = &jd->dcv[i + 1];
+
+                        JD_LOG("huff[%d]", n + i);
+                    }
+                }
+
+                /* Shared buffer for IDCT (64 * sizeof(int32_t)) and RGB ((64 * sizeof(ARGB8888))) output */
+                len = 64 * 4;
+                jd->workbuf = alloc_pool(jd, len);
+                if (!jd->workbuf) {
+                    return JDR_MEM1;
+                }
+
+                /* Allocate MCU working buffer */
+                jd->mcubuf = alloc_pool(jd, (n + 2) * 64 * sizeof(jd_yuv_t));
+                if (!jd->mcubuf) {
+                    return JDR_MEM1;
+                }
+
+                /* Chroma term planes of 4:2:2/4:2:0 */
+                jd->cterm = NULL;
+                if (jd->ncomp == 3 && jd->msx == 2) {
+                    jd->cterm = alloc_pool(jd, 3 * 64 * sizeof(int16_t));
+                    if (!jd->cterm) {
+                        return JDR_MEM1;
+                    }
+                }
+
+                jd->scanofs = ofs;
+                if (jd->mem) {
+                    /* The whole in-memory stream is the input buffer */
+                    jd->inpos = jd->szmem;
+                    jd->dctr = (int32_t)(jd->szmem - ofs);
+                    jd->dptr = (uint8_t *)jd->mem + ofs;
+                } else {
+                    /* Align stream read offset to JD_SZBUF */
+                    if (ofs %= JD_SZBUF) {
+                        jd->dctr = jd->infunc(jd, jd->inbuf + ofs, (int32_t)(JD_SZBUF - ofs));
+                    }
+                    jd->inpos = jd->scanofs + jd->dctr;
+                    jd->dptr = jd->inbuf + ofs - (JD_FASTDECODE ? 0 : 1);
+                }
+                JD_HEXDUMP(jd->dptr, jd->dctr);
+
+                /* Convert to RGB */
+                if ((jd->ncomp == 1) && (jd->msx == 1) && (jd->msy == 1)) {
+                    jd->yuv_scan = yuv400_scan;
+                } else if ((jd->ncomp == 3) && (jd->msx == 1) && (jd->msy == 1)) {
+                    jd->yuv_scan = yuv444_scan;
+                } else if ((jd->ncomp == 3) && (jd->msx == 2) && (jd->msy == 2)) {
+                    jd->yuv_scan = yuv420_scan;
+                } else if ((jd->ncomp == 3) && (jd->msx == 2) && (jd->msy == 1)) {
+                    jd->yuv_scan = yuv422_scan;
+                } else {
+                    return JDR_YUV;
+                }
+
+                /* default Color format */
+                jd->color = JD_RGB888;
+                jd_select_kernel(jd);
+
+#if JD_DEBUG
+                jd_log(jd);
+#endif
+
+                return JDR_OK;      /* Initialization succeeded. Ready to decompress the JPEG image. */
+            }
+            break;
+        case 0xC1:  /* SOF1 */
+        case 0xC2:  /* SOF2 */
+        case 0xC3:  /* SOF3 */
+        case 0xC5:  /* SOF5 */
+        case 0xC6:  /* SOF6 */
+        case 0xC7:  /* SOF7 */
+        case 0xC9:  /* SOF9 */
+        case 0xCA:  /* SOF10 */
+        case 0xCB:  /* SOF11 */
+        case 0xCD:  /* SOF13 */
+        case 0xCE:  /* SOF14 */
+        case 0xCF:  /* SOF15 */
+        case 0xD9:  /* EOI */
+            return JDR_FMT3;    /* Unsuppoted JPEG standard (may be progressive JPEG) */
+        default:    /* Unknown segment (comment, exif or etc..) */
+            JD_LOG("Skip segment marker %02X,%d", marker, len);
+            /* Skip segment data (null pointer specifies to remove data from the stream) */
+            if (jd_load(jd, NULL, ofs - len, len) != len) {
+                return JDR_INP;
+            }
+            break;
+        }
+    }
+}
+
+/*-------------------------------------------------------------------------*/
+// API
+JRESULT jd_prepare(
+    JDEC *jd,               /* Blank decompressor object */
+    jd_infunc_t infunc,     /* JPEG strem input function */
+    void *pool,             /* Working buffer for the decompression session */
+    int32_t sz_pool,        /* Size of working buffer */
+    void *dev               /* I/O device identifier for the session */
+)
+{
+    memset(jd, 0, sizeof(JDEC));    /* Clear decompression object (this might be a problem if machine's null pointer is not all bits zero) */
+    jd->pool = pool;        /* Work memroy */
+    jd->sz_pool = sz_pool;  /* Size of given work memory */
+    jd->infunc = infunc;    /* Stream input function */
+    jd->device = dev;       /* I/O device identifier */
+
+    jd->inbuf = alloc_pool(jd, JD_SZBUF);   /* Allocate stream input buffer */
+    if (!jd->inbuf) {
+        return JDR_MEM1;
+    }
+
+    return jd_parse(jd);
+}
+
+JRESULT jd_prepare_mem(
+    JDEC *jd,               /* Blank decompressor object */
+    const uint8_t *data,    /* JPEG stream in the memory, must be kept during the session */
+    size_t len,             /* Size of the JPEG stream */
+    void *pool,             /* Working buffer for the decompression session */
+    int32_t sz_pool         /* Size of working buffer */
+)
+{
+    memset(jd, 0, sizeof(JDEC));
+    if (!data || len > 0x7FFFFFFF) {
+        return JDR_PAR;
+    }
+    jd->pool = pool;
+    jd->sz_pool = sz_pool;
+    jd->infunc = jd_mem_input;
+    jd->seekfunc = jd_mem_seek;
+    jd->mem = data;         /* No input buffer, the decoder reads the stream in place */
+    jd->szmem = (uint32_t)len;
+
+    return jd_parse(jd);
+}
+
+JRESULT jd_prepare_cursor(
+    JDEC *jd,               /* Blank decompressor object */
+    const JDEC *img,        /* Prepared decompressor object to share the parsed image with */
+    void *pool,             /* Working buffer for the decompression session */
+    int32_t sz_pool,        /* Size of working buffer */
+    void *dev               /* I/O device identifier for the session, at the top of the stream */
+)
+{
+    unsigned int i, n;
+
+    /* Tables, restart index and in-memory stream are referred, not copied */
+    memcpy(jd, img, sizeof(JDEC));
+    jd->pool = pool;
+    jd->sz_pool = sz_pool;
+    jd->device = dev;
+    jd->stripe = NULL;
+    jd->stream = NULL;
+    jd->susp = NULL;
+    jd->prefetch = NULL;
+    jd->fb = NULL;
+    jd->mempos = 0;
+
+    /* Own input, IDCT, MCU and chroma term buffers of the session */
+    n = jd->msx * jd->msy + (jd->ncomp == 3 ? 2 : 0);  /* Number of blocks in the MCU */
+    jd->inbuf = jd->mem ? NULL : alloc_pool(jd, JD_SZBUF);
+    jd->workbuf = alloc_pool(jd, 64 * 4);
+    jd->mcubuf = alloc_pool(jd, n * 64 * sizeof(jd_yuv_t));
+    if ((!jd->mem && !jd->inbuf) || !jd->workbuf || !jd->mcubuf) {
+        return JDR_MEM1;
+    }
+    if (jd->cterm) {
+        jd->cterm = alloc_pool(jd, 3 * 64 * sizeof(int16_t));
+        if (!jd->cterm) {
+            return JDR_MEM1;
+        }
+    }
+
+    /* Own DC predictors */
+    for (i = 0; i < n; i++) {
+        jd->component[i].dcv = &jd->dcv[img->component[i].dcv - img->dcv];
+    }
+    jd->dcv[0] = jd->dcv[1] = jd->dcv[2] = 0;
+
+    if (!jd->mem) {         /* Nothing has been read from the device */
+        jd->dptr = jd->inbuf;
+        jd->dctr = 0;
+        jd->inpos = 0;
+    }
+
+    return JDR_OK;
+}
+
+JRESULT jd_build_index(JDEC *jd)
+{
+    uint32_t n, i, pos;
+    uint8_t *dp, d, last_d = 0;
+    int32_t dc;
+
+    if (!jd || !jd->nrst) {
+        return JDR_PAR;     /* Err: no restart interval in the stream */
+    }
+    if (!jd->seekfunc) {
+        return JDR_PAR;     /* Err: the index is used by seeking back, see jd_set_seek() */
+    }
+
+    /* Number of restart intervals in the scan */
+    n = (jd_mcu_count(jd) + jd->nrst - 1) / jd->nrst;
+
+    if (!jd->rstidx) {
+        jd->rstidx = alloc_pool(jd, n * sizeof(uint32_t));
+        if (!jd->rstidx) {
+            return JDR_MEM1;
+        }
+    }
+    jd->rstidx[0] = jd->scanofs;
+
+    /* Find all RSTn markers from the top of scan */
+    if (jd_seek(jd, jd->scanofs) != JDR_OK) {
+        return JDR_INP;
+    }
+    dp = jd->dptr;
+    dc = jd->dctr;
+    pos = jd->scanofs;
+    for (i = 1; i < n; ) {
+        if (dc == 0) {
+            if (jd->mem) {
+                dc = 0;     /* The in-memory stream has run out */
+            } else if (jd->prefetch) {
+                dc = jd_prefetch_next(jd);
+            } else {
+                dc = jd->infunc(jd, jd->inbuf, JD_SZBUF);
+                if (dc > 0) {
+                    jd->inpos += dc;
+                }
+            }
+            if (dc <= 0) {
+                return JDR_INP;
+            }
+            dp = jd->inbuf;
+        }
+        d = *dp++;
+        dc--;
+        pos++;
+        if (last_d == 0xFF) {
+            if ((d >= 0xD0) && (d <= 0xD7)) {
+                jd->rstidx[i++] = pos;  /* Restart interval starts next to the marker */
+                JD_LOG("RST%u interval %u at %u", d & 7, i - 1, pos);
+            } else if (d == 0xD9) {
+                return JDR_FMT1;    /* Err: EOI in middle of the scan */
+            }
+        }
+        last_d = d;
+    }
+    jd->dptr = dp;
+    jd->dctr = dc;
+
+    /* Rewind to the top of scan */
+    return jd_seek(jd, jd->scanofs);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Restart decoding at the top of a restart interval                     */
+/*-----------------------------------------------------------------------*/
+
+static JRESULT jd_restart(JDEC *jd, uint32_t iint)
+{
+    JD_LOG("Restart interval %u", iint);
+
+    /* Reset DC predictors of all components */
+    jd->dcv[0] = jd->dcv[1] = jd->dcv[2] = 0;
+
+    return jd_seek(jd, jd->rstidx[iint]);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Bit reader of the entropy-coded data                                  */
+/*-----------------------------------------------------------------------*/
+/* The accumulator holds the next cnt bits of the stream from its MSB and is
+/  refilled a word at a time while the input has no 0xFF byte. Stuffed bytes,
+/  fill bytes and markers are handled a byte at a time. The reader stops at
+/  an RSTn/EOI marker, so the accumulator never runs past the interval. */
+
+#if JD_FASTDECODE >= 1 && defined(UINTPTR_MAX) && UINTPTR_MAX > 0xFFFFFFFF
+typedef uint64_t jd_bits_t;
+#define JD_BITS         64      /* 64-bit accumulator, refilled 32 bits at a time */
+#define JD_CHUNK        4
+#define LD_CHUNK(p)     ((uint32_t)(p)[0] << 24 | (uint32_t)(p)[1] << 16 | (uint32_t)(p)[2] << 8 | (p)[3])
+#define HAS_FF(w)       ((~(w) - 0x01010101) & (w) & 0x80808080)
+#else
+typedef uint32_t jd_bits_t;
+#define JD_BITS         32      /* 32-bit accumulator, refilled 16 bits at a time */
+#define JD_CHUNK        2
+#define LD_CHUNK(p)     LDB_WORD(p)
+#define HAS_FF(w)       (((w) & 0xFF00) == 0xFF00 || ((w) & 0xFF) == 0xFF)
+#endif
+
+#define PEEK_BITS(br)       ((uint32_t)((br)->reg >> (JD_BITS - 32)))   /* Next 32 bits */
+#define SKIP_BITS(br, n)    do { (br)->reg <<= (n); (br)->cnt -= (n); } while (0)
+
+typedef struct {
+    jd_bits_t reg;      /* Bit accumulator */
+    uint8_t cnt;        /* Number of valid bits in the accumulator */
+    uint8_t marker;     /* RSTn/EOI marker the reader stopped at (0: not found) */
+    uint8_t *dp;        /* Current data read ptr */
+    int32_t dc;         /* Number of bytes available in the input buffer */
+    uint8_t *mark;      /* Top of the bytes kept in the input buffer to roll back to (NULL: none) */
+} JBITS;
+
+typedef struct {
+    JBITS br;           /* Bit reader at the next MCU */
+    uint32_t imcu;      /* Index of the next MCU */
+    int x, y;           /* Position of the next MCU */
+    bool rst;           /* Restart interval ends before the next MCU */
+    bool active;        /* The scan has been started */
+} JSCANPOS;
+
+typedef struct {
+    JSCANPOS pos;       /* Position of the suspended decoding (except band streaming) */
+    uint32_t budget;    /* Number of MCUs to be decoded per call (0: no limit) */
+    int32_t szbuf;      /* Size of the input buffer, JD_SZBUF and the room to keep an MCU in */
+} JSUSPEND;
+
+/* Compressed size of a block at most: the longest DC and 63 AC codes with their values, every byte stuffed */
+#define JD_MAX_BLOCK    (2 * ((16 + 11 + 63 * (16 + 10) + 7) / 8))
+
+/* Get a byte from the input buffer, reload it when empty (0: no more data) */
+static inline int jd_get_byte(JDEC *jd, JBITS *br, uint8_t *d)
+{
+    int32_t n = 0, sz = JD_SZBUF;
+
+    if (br->dc <= 0) {
+        if (jd->prefetch) {
+            /* The drained buffer is read into next, the MCU cannot be rolled back */
+            br->mark = NULL;
+            br->dc = jd_prefetch_next(jd);
+            br->dp = jd->inbuf;
+            if (br->dc <= 0) {
+                br->dc = 0;
+                return 0;
+            }
+            *d = *br->dp++;
+            br->dc--;
+            return 1;
+        }
+        if (jd->mem) {
+            /* The in-memory stream has run out, there is no input buffer to refill */
+            br->dc = 0;
+            return 0;
+        }
+        if (br->mark) {
+            /* Keep the bytes from the mark at top of the input buffer, enlarged by jd_set_suspend() */
+            sz = ((JSUSPEND *)jd->susp)->szbuf;
+            n = (int32_t)(br->dp - br->mark);
+            if (n < sz) {
+                memmove(jd->inbuf, br->mark, n);
+                br->mark = jd->inbuf;
+            } else {
+                br->mark = NULL;    /* Too many bytes to be kept */
+                n = 0;
+            }
+        }
+        br->dp = jd->inbuf + n;     /* Top of input buffer */
+        br->dc = jd->infunc(jd, br->dp, sz - n < JD_SZBUF ? sz - n : JD_SZBUF);
+        if (br->dc <= 0) {
+            br->dc = 0;
+            return 0;
+        }
+        jd->inpos += br->dc;
+    }
+    *d = *br->dp++;
+    br->dc--;
+
+    return 1;
+}
+
+/* Load the accumulator as full as possible */
+static JRESULT jd_fill_bits(JDEC *jd, JBITS *br)
+{
+    uint32_t w;
+    uint8_t d;
+
+    while (br->cnt <= JD_BITS - 8 && !br->marker) {
+        if (br->dc >= JD_CHUNK && br->cnt <= JD_BITS - JD_CHUNK * 8) {
+            w = LD_CHUNK(br->dp);
+            if (!HAS_FF(w)) {
+                /* Fast path: the chunk has no stuffed byte nor marker */
+                br->reg |= (jd_bits_t)w << (JD_BITS - JD_CHUNK * 8 - br->cnt);
+                br->cnt += JD_CHUNK * 8;
+                br->dp += JD_CHUNK;
+                br->dc -= JD_CHUNK;
+                continue;
+            }
+        }
+
+        /* Slow path: a byte at a time */
+        if (!jd_get_byte(jd, br, &d)) {
+            JD_LOG("No more data, %d", br->cnt);
+            return JDR_INP;     /* Err: read error or wrong stream termination */
+        }
+        if (d == 0xFF) {
+            do {    /* Skip fill bytes */
+                if (!jd_get_byte(jd, br, &d)) {
+                    return JDR_INP;
+                }
+            } while (d == 0xFF);
+            if (d != 0x00) {
+                JD_LOG("Found marker %02X", d);
+                if (d == 0xD9 || (d >= 0xD0 && d <= 0xD7)) {
+                    br->marker = d;     /* End of the interval or the scan */
+                }
+                continue;   /* The other markers are ignored */
+            }
+            d = 0xFF;   /* Stuffed byte */
+        }
+        br->reg |= (jd_bits_t)d << (JD_BITS - 8 - br->cnt);
+        br->cnt += 8;
+    }
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Decode a block and update the DC predictor of the component           */
+/*-----------------------------------------------------------------------*/
+/* blk: Block to store the coefficients (NULL: only the DC predictor is kept),
+/  ac: Store AC coefficients too, eob: Last zigzag index stored */
+
+static inline JRESULT jd_decode_block(JDEC *jd, JBITS *br, JCOMP *component, jd_yuv_t *blk, bool ac, uint8_t *eob)
+{
+    unsigned int k;
+    uint8_t bl, bl1, val;
+    int ebits;
+
+    /* DC component */
+    if (br->cnt < 16 && jd_fill_bits(jd, br) != JDR_OK) {
+        return JDR_INP;
+    }
+    bl = jd_get_hc(&component->huff[0], 0, PEEK_BITS(br), br->cnt, &val);
+    if (!bl) {
+        JD_LOG("DC Huffman code too short: %08X %u", PEEK_BITS(br), br->cnt);
+        return JDR_FMT1;
+    }
+    SKIP_BITS(br, bl);
+    bl1 = val & 0x0F;
+    ebits = 0;
+    if (bl1) {
+        if (br->cnt < bl1 && jd_fill_bits(jd, br) != JDR_OK) {
+            return JDR_INP;
+        }
+        if (br->cnt < bl1) {
+            return JDR_FMT1;
+        }
+        ebits = (int)(br->reg >> (JD_BITS - bl1));
+        if (!(br->reg >> (JD_BITS - 1))) {
+            ebits -= (1 << bl1) - 1;    /* Restore negative value if needed */
+        }
+        SKIP_BITS(br, bl1);
+    }
+    ebits += *component->dcv;
+    *component->dcv = (int16_t)ebits;
+    if (blk) {
+        blk[0] = (jd_yuv_t)ebits;
+        *eob = 0;
+    }
+
+    /* AC components */
+    for (k = 1; k < 64; k++) {
+        if (br->cnt < 16 && jd_fill_bits(jd, br) != JDR_OK) {
+            return JDR_INP;
+        }
+        bl = jd_get_hc(&component->huff[1], 1, PEEK_BITS(br), br->cnt, &val);
+        if (!bl) {
+            JD_LOG("AC Huffman code too short: %08X %u", PEEK_BITS(br), br->cnt);
+            return JDR_FMT1;
+        }
+        SKIP_BITS(br, bl);
+        if (val == 0) {
+            break;  /* EOB */
+        }
+        k += val >> 4;      /* Zero run */
+        bl1 = val & 0x0F;
+        if (bl1) {
+            if (br->cnt < bl1 && jd_fill_bits(jd, br) != JDR_OK) {
+                return JDR_INP;
+            }
+            if (br->cnt < bl1 || k > 63) {
+                return JDR_FMT1;    /* Err: coefficient out of the block */
+            }
+            if (ac && blk) {
+                ebits = (int)(br->reg >> (JD_BITS - bl1));
+                if (!(br->reg >> (JD_BITS - 1))) {
+                    ebits -= (1 << bl1) - 1;
+                }
+                blk[Zig[k]] = (jd_yuv_t)ebits;     /* Reverse zigzag */
+                *eob = (uint8_t)k;
+            }
+            SKIP_BITS(br, bl1);
+        }
+        /* bl1 == 0: ZRL, 16 zeros including the current position */
+    }
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Pass the quantized coefficients of an MCU to the coefficient function */
+/*-----------------------------------------------------------------------*/
+
+static int jd_output_coef(JDEC *jd, uint8_t n_cmp, int x, int y)
+{
+    int16_t *coef = (int16_t *)jd->workbuf;
+    const jd_yuv_t *p;
+    uint8_t n_y = jd->msx * jd->msy, cmp;
+    unsigned int i;
+    JBLOCK blk;
+
+    blk.coef = coef;
+    for (cmp = 0; cmp < n_cmp; cmp++) {
+        p = &jd->mcubuf[cmp << 6];      // cmp * 64
+        if (jd->zigzag) {
+            for (i = 0; i < 64; i++) {
+                coef[i] = p[Zig[i]];
+            }
+        } else {
+            for (i = 0; i < 64; i++) {
+                coef[i] = p[i];
+            }
+        }
+        if (cmp < n_y) {    /* Y blocks of the MCU in raster order */
+            blk.cmp = 0;
+            blk.bx = (uint16_t)(x / 8 + cmp % jd->msx);
+            blk.by = (uint16_t)(y / 8 + cmp / jd->msx);
+        } else {            /* A Cb/Cr block per MCU */
+            blk.cmp = cmp - n_y + 1;
+            blk.bx = (uint16_t)(x / (jd->msx << 3));
+            blk.by = (uint16_t)(y / (jd->msy << 3));
+        }
+        blk.qtid = jd->component[cmp].qtid;
+        blk.eob = jd->eobidx[cmp];
+        if (!jd->coeffunc(jd, &blk)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Go over the end of a restart interval                                 */
+/*-----------------------------------------------------------------------*/
+/* With the restart index, jumps to the interval which has the next MCU to be
+/  decoded (*imcu: its top, jd_mcu_count(): no more MCU up to iend). Without
+/  it, the RST marker is read and the DC predictors are reset. */
+
+static JRESULT jd_next_interval(JDEC *jd, JBITS *br, const JRECT *tgt_rect, uint32_t *imcu, uint32_t iend)
+{
+    uint32_t n;
+
+    jd->dptr = br->dp;
+    jd->dctr = br->dc;
+    if (jd->rstidx) {
+        /* Jump to the next restart interval to be decoded */
+        n = jd_next_mcu(jd, tgt_rect, *imcu);
+        if (n >= jd_mcu_count(jd) || n / jd->nrst >= iend) {
+            *imcu = jd_mcu_count(jd);
+            return JDR_OK;
+        }
+        n -= n % jd->nrst;
+        if (jd_restart(jd, n / jd->nrst) != JDR_OK) {
+            return JDR_INP;
+        }
+        br->dp = jd->dptr;
+        br->dc = jd->dctr;
+        br->reg = 0;
+        br->cnt = 0;
+        br->marker = 0;
+        br->mark = NULL;
+        *imcu = n;
+        return JDR_OK;
+    }
+    if (!br->marker && jd_fill_bits(jd, br) != JDR_OK) {
+        return JDR_INP;     /* Err: RST marker was not found */
+    }
+    /* The rest bits of the interval are padding, restart at the RST marker */
+    if (br->marker >= 0xD0 && br->marker <= 0xD7) {
+        JD_LOG("RST marker %02X", br->marker);
+        jd->dcv[0] = jd->dcv[1] = jd->dcv[2] = 0;
+        br->marker = 0;
+        br->reg = 0;
+        br->cnt = 0;
+    }
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Suspend the scan decoding                                             */
+/*-----------------------------------------------------------------------*/
+
+/* Keep the position of the next MCU */
+static JRESULT jd_suspend(JDEC *jd, JBITS *br, uint32_t imcu, int x, int y, bool rst, JSCANPOS *pos)
+{
+    jd->dptr = br->dp;
+    jd->dctr = br->dc;
+    pos->br = *br;
+    pos->imcu = imcu;
+    pos->x = x;
+    pos->y = y;
+    pos->rst = rst;
+    pos->active = true;
+
+    return JDR_SUSPEND;
+}
+
+/* The input ran out in an MCU, roll back to the top of it (ck) */
+static JRESULT jd_rollback(JDEC *jd, JBITS *br, JBITS *ck, const int16_t *dcv, uint32_t imcu, int x, int y, bool rst, JSCANPOS *pos)
+{
+    uint8_t *mark = br->mark, *end = br->dp + br->dc;
+
+    if (!mark || jd->mem) {
+        return JDR_INP;     /* Err: the bytes of the MCU have not been kept */
+    }
+    JD_LOG("Input ran out, suspended at MCU %u", imcu);
+    *br = *ck;
+    br->dp = br->mark = mark;   /* The bytes from the top of the MCU are at the mark */
+    br->dc = (int32_t)(end - mark);
+    memcpy(jd->dcv, dcv, 3 * sizeof(int16_t));
+
+    return jd_suspend(jd, br, imcu, x, y, rst, pos);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Decode the scan from restart interval iint up to (not including) iend */
+/*-----------------------------------------------------------------------*/
+/* With pos, the decoding is resumed at pos (if active) and pos is updated
+/  to the MCU next to the last one in the rectangle. When suspension is
+/  enabled, JDR_SUSPEND is returned with pos at the MCU to be resumed at. */
+
+static JRESULT jd_decomp_scan(JDEC *jd, JRECT *tgt_rect, uint32_t iint, uint32_t iend, JSCANPOS *pos)
+{
+    JBITS br, ck;
+    uint8_t n_y, n_cmp, n_out, cmp;
+    int x = 0, y = 0;
+    bool skip, rst = false;
+    bool dc_only = jd->scale == 3 && !jd->coeffunc;     /* 1/8 output needs only the DC of each block */
+    uint32_t nmx, nmcu, imcu = 0, imcu_last, nproc = 0;
+    int16_t ckdcv[3];
+    JSUSPEND *su = pos ? (JSUSPEND *)jd->susp : NULL;  /* Suspension is enabled */
+    JRECT mcu_rect;
+    jd_yuv_t *blk;
+    JRESULT rc;
+
+    n_y = jd->msy * jd->msx; /* Number of Y blocks in the MCU */
+    if (jd->ncomp == 1) {
+        n_cmp = n_y;
+    } else if (jd->ncomp == 3) {
+        n_cmp = n_y + 2;
+    } else {
+        return JDR_FMT1;    /* Err: Supports only Grayscale and Y/Cb/Cr */
+    }
+    n_out = jd_luma_only(jd) ? n_y : n_cmp;   /* Blocks to be transformed */
+    nmx = (jd->width + (jd->msx << 3) - 1) / (jd->msx << 3);    /* Number of MCUs in a row */
+    nmcu = jd_mcu_count(jd);
+    imcu_last = jd_last_mcu(jd, tgt_rect);
+    if (jd_next_mcu(jd, tgt_rect, 0) >= nmcu) {
+        return JDR_OK;  /* Rectangle is out of the image */
+    }
+
+    if (pos && pos->active) {
+        /* Resume at the MCU next to the previous rectangle or the suspended one */
+        br = pos->br;
+        imcu = pos->imcu;
+        x = pos->x;
+        y = pos->y;
+        rst = pos->rst;
+        if (jd->rstidx && jd_next_mcu(jd, tgt_rect, imcu) / jd->nrst != imcu / jd->nrst) {
+            rst = true;     /* Jump to a later interval */
+        }
+    } else {
+        if (jd->rstidx) {
+            /* Jump to the restart interval which has the first MCU to be decoded */
+            imcu = jd_next_mcu(jd, tgt_rect, iint * jd->nrst);
+            if (imcu >= nmcu || imcu / jd->nrst >= iend) {
+                return JDR_OK;  /* Nothing to decode */
+            }
+            imcu -= imcu % jd->nrst;
+            rc = jd_restart(jd, imcu / jd->nrst);
+            if (rc != JDR_OK) {
+                return rc == JDR_INP && su && !jd->mem ? JDR_SUSPEND : rc;  /* Starts over when resumed */
+            }
+            x = (imcu % nmx) * (jd->msx << 3);
+            y = (imcu / nmx) * (jd->msy << 3);
+        } else {
+            /* Decode from the top of scan */
+            jd->dcv[0] = jd->dcv[1] = jd->dcv[2] = 0;
+            rc = jd_seek(jd, jd->scanofs);
+            if (rc != JDR_OK) {
+                return rc == JDR_INP && su && !jd->mem ? JDR_SUSPEND : rc;  /* Starts over when resumed */
+            }
+        }
+        br.reg = 0;
+        br.cnt = 0;
+        br.marker = 0;
+        br.mark = NULL;
+        br.dp = jd->dptr;
+        br.dc = jd->dctr;
+    }
+
+    for (;;) {
+        if (su) {
+            if (su->budget && nproc >= su->budget) {
+                JD_LOG("MCU budget used up");
+                return jd_suspend(jd, &br, imcu, x, y, rst, pos);
+            }
+            /* Roll back to here when the input runs out in this MCU */
+            br.mark = br.dp;
+            ck = br;
+            memcpy(ckdcv, jd->dcv, sizeof ckdcv);
+        }
+        if (rst) {
+            /* End of restart interval */
+            rc = jd_next_interval(jd, &br, tgt_rect, &imcu, iend);
+            if (rc != JDR_OK) {
+                if (rc == JDR_INP && su) {
+                    if (jd->rstidx) {   /* Jumps again when resumed */
+                        return jd->mem ? rc : jd_suspend(jd, &br, imcu, x, y, true, pos);
+                    }
+                    return jd_rollback(jd, &br, &ck, ckdcv, imcu, x, y, true, pos);
+                }
+                return rc;
+            }
+            if (imcu >= nmcu) {
+                JD_LOG("All MCUs in the rectangle processed");
+                return JDR_OK;
+            }
+            x = (imcu % nmx) * (jd->msx << 3);
+            y = (imcu / nmx) * (jd->msy << 3);
+            rst = false;
+            if (su) {
+                br.mark = br.dp;
+                ck = br;
+                memcpy(ckdcv, jd->dcv, sizeof ckdcv);
+            }
+        }
+        skip = is_mcu_skipped(jd, tgt_rect, x, y);
+
+        /* Decode the blocks of an MCU (MCUs out of the rectangle and unused Cb/Cr only keep the DC predictors) */
+        for (cmp = 0; cmp < n_cmp; cmp++) {
+            blk = skip || cmp >= n_out ? NULL : &jd->mcubuf[cmp << 6];  // cmp * 64
+            if (blk && !dc_only) {
+                memset(blk + 1, 0, 63 * sizeof(jd_yuv_t));
+            }
+            rc = jd_decode_block(jd, &br, &jd->component[cmp], blk, !dc_only, &jd->eobidx[cmp]);
+            if (rc != JDR_OK) {
+                if (rc == JDR_INP && su) {
+                    return jd_rollback(jd, &br, &ck, ckdcv, imcu, x, y, false, pos);
+                }
+                jd->dptr = br.dp;
+                jd->dctr = br.dc;
+                return rc;
+            }
+        }
+        nproc++;
+
+        if (!skip) {
+            mcu_rect.left = x;
+            mcu_rect.top = y;
+            mcu_rect.right = x + (jd->msx << 3) - 1;
+            mcu_rect.bottom = y + (jd->msy << 3) - 1;
+            JD_LOG("MCU (%u,%u,%u,%u) to be output", mcu_rect.left, mcu_rect.top, mcu_rect.right, mcu_rect.bottom);
+            if (!jd->coeffunc) {
+                jd_output(jd, n_out, &mcu_rect, tgt_rect);
+            } else if (!jd_output_coef(jd, n_cmp, x, y)) {
+                jd->dptr = br.dp;
+                jd->dctr = br.dc;
+                return JDR_INTR;    /* Interrupted by the coefficient function */
+            }
+        }
+
+        x += jd->msx << 3;
+        if (x >= jd->width) {
+            x = 0;
+            y += jd->msy << 3;
+            if (y >= jd->height) {
+                JD_LOG("All MCUs processed (%u bits left)", br.cnt);
+                break;
+            }
+        }
+
+        imcu++;
+        rst = jd->nrst && (imcu % jd->nrst) == 0;
+        if (imcu > imcu_last) {
+            JD_LOG("Last MCU in the rectangle processed");
+            if (pos) {
+                /* Keep the position to resume at */
+                pos->br = br;
+                pos->imcu = imcu;
+                pos->x = x;
+                pos->y = y;
+                pos->rst = rst;
+                pos->active = true;
+            }
+            break;
+        }
+    }
+
+    jd->dptr = br.dp;
+    jd->dctr = br.dc;
+
+    return JDR_OK;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Copy the part of a block in the destination rectangle                 */
+/*-----------------------------------------------------------------------*/
+
+static void jd_copy_block(
+    uint8_t *dst,           /* Destination surface */
+    int32_t stride,         /* Bytes per line of the destination */
+    const JRECT *dst_rect,  /* Region of the image in the destination */
+    const void *bitmap,     /* Block pixels */
+    const JRECT *rect,      /* Region of the block */
+    int bpp                 /* Bytes per pixel */
+)
+{
+    int bw = rect->right - rect->left + 1;
+    int x0, x1, y0, y1, y;
+
+    x0 = rect->left > dst_rect->left ? rect->left : dst_rect->left;
+    x1 = rect->right < dst_rect->right ? rect->right : dst_rect->right;
+    y0 = rect->top > dst_rect->top ? rect->top : dst_rect->top;
+    y1 = rect->bottom < dst_rect->bottom ? rect->bottom : dst_rect->bottom;
+    for (y = y0; y <= y1 && x0 <= x1; y++) {
+        memcpy(dst + (y - dst_rect->top) * stride + (x0 - dst_rect->left) * bpp,
+               (const uint8_t *)bitmap + ((y - rect->top) * bw + (x0 - rect->left)) * bpp, (x1 - x0 + 1) * bpp);
+    }
+}
+
+/*-----------------------------------------------------------------------*/
+/* Stripe output: collect the blocks of an MCU row and output at a time  */
+/*-----------------------------------------------------------------------*/
+
+typedef struct {
+    uint8_t *buf;           /* Stripe buffer */
+    uint32_t szbuf;         /* Size of the stripe buffer */
+    uint16_t nmcu;          /* Stripe width in unit of MCU (0: turned off by jd_clear_stripe()) */
+    uint16_t col0;          /* MCU column of the left end of the rectangle */
+    uint16_t row, idx;      /* MCU row and index in the row of the current stripe */
+    bool valid;             /* The current stripe has pixels */
+    JRECT clip;             /* Rectangle to be output, clipped to the image */
+    JRECT rect;             /* Rectangle of the current stripe */
+    jd_outfunc_t outfunc;   /* Output function of the application */
+} JSTRIPE;
+
+static void jd_stripe_flush(JDEC *jd)
+{
+    JSTRIPE *st = (JSTRIPE *)jd->stripe;
+
+    if (st->valid) {
+        st->outfunc(jd, st->buf, &st->rect);
+        st->valid = false;
+    }
+}
+
+static int jd_stripe_out(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    JSTRIPE *st = (JSTRIPE *)jd->stripe;
+    uint32_t mw = (jd->msx << 3) >> jd->scale, mh = (jd->msy << 3) >> jd->scale;
+    uint16_t row = rect->top / mh, idx = (rect->left / mw - st->col0) / st->nmcu;
+    int32_t l, r;
+
+    if (st->valid && (row != st->row || idx != st->idx)) {
+        jd_stripe_flush(jd);
+    }
+    if (!st->valid) {
+        /* Start a stripe: MCU row clipped to the rectangle */
+        l = (st->col0 + idx * st->nmcu) * mw;
+        r = l + st->nmcu * mw - 1;
+        st->rect.left = l > st->clip.left ? l : st->clip.left;
+        st->rect.right = r < st->clip.right ? r : st->clip.right;
+        l = row * mh;
+        r = l + mh - 1;
+        st->rect.top = l > st->clip.top ? l : st->clip.top;
+        st->rect.bottom = r < st->clip.bottom ? r : st->clip.bottom;
+        if (st->rect.left > st->rect.right || st->rect.top > st->rect.bottom) {
+            return 1;   /* Out of the rectangle */
+        }
+        st->row = row;
+        st->idx = idx;
+        st->valid = true;
+    }
+    jd_copy_block(st->buf, (st->rect.right - st->rect.left + 1) * jd_color_bpp[jd->color], &st->rect, bitmap, rect, jd_color_bpp[jd->color]);
+
+    return 1;
+}
+
+/*-----------------------------------------------------------------------*/
+/* Decode the whole rectangle, resumed if the last call was suspended    */
+/*-----------------------------------------------------------------------*/
+
+static inline bool jd_resuming(JDEC *jd)
+{
+    return jd->susp && ((JSUSPEND *)jd->susp)->pos.active;
+}
+
+static JRESULT jd_decomp_all(JDEC *jd, JRECT *tgt_rect)
+{
+    JSCANPOS *pos = jd->susp ? &((JSUSPEND *)jd->susp)->pos : NULL;
+    JRESULT rc;
+
+    rc = jd_decomp_scan(jd, tgt_rect, 0, 0xFFFFFFFF, pos);
+    if (pos && rc != JDR_SUSPEND) {
+        pos->active = false;    /* The next call starts a new decoding */
+    }
+
+    return rc;
+}
+
+JRESULT jd_decomp_rect(JDEC *jd, jd_outfunc_t outfunc, JRECT *tgt_rect)
+{
+    JSTRIPE *st = (JSTRIPE *)jd->stripe;
+    JRECT full, *scan_rect = jd_unscale_rect(jd, tgt_rect, &full);
+    JRESULT rc;
+
+    jd->outfunc = outfunc;
+    if (!st || !st->nmcu) {
+        return jd_decomp_all(jd, scan_rect);
+    }
+
+    /* Stripe output (a resumed decoding continues the pending stripe) */
+    if (!jd_resuming(jd)) {
+        st->clip.left = 0;
+        st->clip.top = 0;
+        st->clip.right = jd_scaled(jd, jd->width) - 1;
+        st->clip.bottom = jd_scaled(jd, jd->height) - 1;
+        if (tgt_rect) {
+            if (tgt_rect->left > st->clip.left) {
+                st->clip.left = tgt_rect->left;
+            }
+            if (tgt_rect->top > st->clip.top) {
+                st->clip.top = tgt_rect->top;
+            }
+            if (tgt_rect->right < st->clip.right) {
+                st->clip.right = tgt_rect->right;
+            }
+            if (tgt_rect->bottom < st->clip.bottom) {
+                st->clip.bottom = tgt_rect->bottom;
+            }
+        }
+        st->col0 = st->clip.left / ((jd->msx << 3) >> jd->scale);
+        st->valid = false;
+    }
+    st->outfunc = outfunc;
+    jd->outfunc = jd_stripe_out;
+    rc = jd_decomp_all(jd, scan_rect);
+    if (rc == JDR_OK) {
+        jd_stripe_flush(jd);
+    }
+    jd->outfunc = outfunc;
+
+    return rc;
+}
+
+JRESULT jd_decomp(JDEC *jd, jd_outfunc_t outfunc, uint8_t scale)
+{
+    JRESULT rc;
+
+    rc = jd_set_scale(jd, scale);
+    if (rc != JDR_OK) {
+        return rc;
+    }
+
+    return jd_decomp_rect(jd, outfunc, NULL);
+}
+
+JRESULT jd_set_scale(JDEC *jd, uint8_t scale)
+{
+    if (!jd) {
+        return JDR_PAR;
+    }
+#if JD_USE_SCALE
+    if (scale > 3) {
+        return JDR_PAR;
+    }
+#else
+    if (scale) {
+        return JDR_PAR;
+    }
+#endif
+
+    jd->scale = scale;
+
+    return JDR_OK;
+}
+
+JRESULT jd_set_color(JDEC *jd, JCOLOR color)
+{
+    if (!jd) {
+        return JDR_PAR;
+    }
+
+    jd->color = color;
+    jd_select_kernel(jd);
+
+    return JDR_OK;
+}
+
+JRESULT jd_decomp_to_buffer(JDEC *jd, JRECT *rect, void *dst, int32_t stride)
+{
+    JRECT clip, full;
+    JRESULT rc;
+
+    if (!jd || !dst) {
+        return JDR_PAR;
+    }
+
+    /* Rectangle clipped to the (scaled) image, dst is the top-left of it */
+    clip.left = 0;
+    clip.top = 0;
+    clip.right = jd_scaled(jd, jd->width) - 1;
+    clip.bottom = jd_scaled(jd, jd->height) - 1;
+    if (rect) {
+        clip.left = rect->left;
+        clip.top = rect->top;
+        if (rect->right < clip.right) {
+            clip.right = rect->right;
+        }
+        if (rect->bottom < clip.bottom) {
+            clip.bottom = rect->bottom;
+        }
+        if (clip.left > clip.right || clip.top > clip.bottom) {
+            return JDR_OK;  /* Nothing to be decoded */
+        }
+    }
+
+    jd->fb = (uint8_t *)dst;
+    jd->fbstride = stride;
+    jd->fbrect = clip;
+    rc = jd_decomp_all(jd, jd_unscale_rect(jd, &clip, &full));
+    jd->fb = NULL;
+
+    return rc;
+}
+
+JRESULT jd_decomp_multi(JDEC *jd, JREGION *region, uint8_t nregion)
+{
+    JRECT bound, full;
+    jd_outfunc_t outfunc;
+    unsigned int i;
+    JRESULT rc;
+
+    if (!jd || !region || !nregion) {
+        return JDR_PAR;
+    }
+
+    /* The scan is limited to the bounding box of the regions */
+    bound = region[0].rect;
+    for (i = 0; i < nregion; i++) {
+        if (!region[i].outfunc && !region[i].buf) {
+            return JDR_PAR;
+        }
+        if (region[i].rect.left < bound.left) {
+            bound.left = region[i].rect.left;
+        }
+        if (region[i].rect.top < bound.top) {
+            bound.top = region[i].rect.top;
+        }
+        if (region[i].rect.right > bound.right) {
+            bound.right = region[i].rect.right;
+        }
+        if (region[i].rect.bottom > bound.bottom) {
+            bound.bottom = region[i].rect.bottom;
+        }
+    }
+
+    /* Each MCU is decoded once and converted into every region it intersects */
+    outfunc = jd->outfunc;
+    jd->region = region;
+    jd->nregion = nregion;
+    rc = jd_decomp_all(jd, jd_unscale_rect(jd, &bound, &full));
+    jd->region = NULL;
+    jd->fb = NULL;
+    jd->outfunc = outfunc;
+
+    return rc;
+}
+
+JRESULT jd_decomp_coef(JDEC *jd, jd_coeffunc_t coeffunc, JRECT *rect, bool zigzag)
+{
+    JRESULT rc;
+
+    if (!jd || !coeffunc || sizeof(jd_yuv_t) < sizeof(int16_t)) {
+        return JDR_PAR;     /* Err: the MCU buffer cannot hold coefficients (JD_FASTDECODE = 0) */
+    }
+
+    /* Entropy decoding only: no dequantization, IDCT nor color conversion */
+    jd->coeffunc = coeffunc;
+    jd->zigzag = zigzag;
+    rc = jd_decomp_all(jd, rect);   /* rect is in the full size image */
+    jd->coeffunc = NULL;
+
+    return rc;
+}
+
+JRESULT jd_decomp_dc(JDEC *jd, void *dst, int32_t stride)
+{
+    uint8_t scale;
+    JRESULT rc;
+
+    if (!jd) {
+        return JDR_PAR;
+    }
+
+    /* 1/8 image: a pixel per block from its DC, the AC coefficients are only parsed */
+    scale = jd->scale;
+    jd->scale = 3;
+    rc = jd_decomp_to_buffer(jd, NULL, dst, stride);
+    jd->scale = scale;
+
+    return rc;
+}
+
+JRESULT jd_set_stripe(JDEC *jd, uint16_t span)
+{
+    uint32_t mw, mh, nmcu, szbuf;
+    int32_t need = 0;
+    JSTRIPE *st;
+
+    if (!jd || !jd->msx) {
+        return JDR_PAR;
+    }
+    mw = jd->msx << 3;
+    mh = jd->msy << 3;
+
+    if (!span || span > jd->width) {
+        span = jd->width;   /* Full image width */
+    }
+    nmcu = span < mw ? 1 : span / mw;
+    szbuf = nmcu * mw * mh * 4;     /* For 4 bytes/pixel at most */
+
+    /* The state is reused and the buffer is renewed only to grow it, check the pool for both at first */
+    st = (JSTRIPE *)jd->stripe;
+    if (!st) {
+        need += ((int32_t)(-(uintptr_t)jd->pool & 7) + (int32_t)sizeof(JSTRIPE) + 3) & ~3;
+    }
+    if (!st || st->szbuf < szbuf) {
+        need += (int32_t)szbuf;
+    }
+    if (need > jd->sz_pool) {
+        return JDR_MEM1;
+    }
+    if (!st) {
+        st = alloc_pool_aligned(jd, sizeof(JSTRIPE));
+        st->szbuf = 0;
+        jd->stripe = st;
+    }
+    if (st->szbuf < szbuf) {
+        st->buf = alloc_pool(jd, (int32_t)szbuf);
+        st->szbuf = szbuf;
+    }
+    st->nmcu = (uint16_t)nmcu;
+
+    return JDR_OK;
+}
+
+JRESULT jd_clear_stripe(JDEC *jd)
+{
+    if (!jd || jd_resuming(jd)) {
+        return JDR_PAR;     /* Err: the suspended decoding has a pending stripe */
+    }
+
+    /* Back to output per block, the state and its buffer are kept for jd_set_stripe() */
+    if (jd->stripe) {
+        ((JSTRIPE *)jd->stripe)->nmcu = 0;
+    }
+
+    return JDR_OK;
+}
+
+/* The pool is not freed, so the JD_SZBUF input buffer of jd_prepare() is left unused when the
+/  larger one is taken: suspension costs JD_SZBUF bytes of pool on top of the new buffer. */
+
+JRESULT jd_set_suspend(JDEC *jd, uint32_t budget)
+{
+    JSUSPEND *su;
+    uint8_t *buf;
+    int32_t szbuf = 0, need;
+
+    if (!jd || !jd->msx || jd->prefetch) {
+        return JDR_PAR;     /* Err: the prefetched input cannot roll back a starved MCU */
+    }
+
+    if (!jd->susp) {
+        /* The input buffer is renewed with the room for the largest MCU to be rolled back,
+           which does not apply to the in-memory stream */
+        if (!jd->mem) {
+            szbuf = JD_SZBUF + (jd->msx * jd->msy + (jd->ncomp == 3 ? 2 : 0)) * JD_MAX_BLOCK;
+        }
+        need = (((int32_t)(-(uintptr_t)jd->pool & 7) + (int32_t)sizeof(JSUSPEND) + 3) & ~3) + ((szbuf + 3) & ~3);
+        if (need > jd->sz_pool) {
+            return JDR_MEM1;
+        }
+        su = alloc_pool_aligned(jd, sizeof(JSUSPEND));
+        su->pos.active = false;
+        su->szbuf = JD_SZBUF;
+        if (szbuf) {
+            buf = alloc_pool(jd, szbuf);
+            memcpy(buf, jd->inbuf, JD_SZBUF);   /* Bytes read so far, at the same offsets */
+            jd->dptr = buf + (jd->dptr - jd->inbuf);
+            jd->inbuf = buf;
+            su->szbuf = szbuf;
+        }
+        jd->susp = su;
+    }
+    ((JSUSPEND *)jd->susp)->budget = budget;
+
+    return JDR_OK;
+}
+
+JRESULT jd_set_seek(JDEC *jd, jd_seekfunc_t seekfunc)
+{
+    if (!jd || jd->mem || !seekfunc) {
+        return JDR_PAR;     /* Err: in-memory stream is seeked in place */
+    }
+    jd->seekfunc = seekfunc;
+
+    return JDR_OK;
+}
+
+JRESULT jd_set_prefetch(JDEC *jd, jd_startfunc_t start, jd_waitfunc_t wait)
+{
+    JPREFETCH *pf;
+
+    if (!jd || jd->mem || !start || !wait) {
+        return JDR_PAR;     /* Err: in-memory stream is not read */
+    }
+    if (jd->susp) {
+        return JDR_PAR;     /* Err: a starved MCU cannot be rolled back across the buffer swap */
+    }
+
+    pf = (JPREFETCH *)jd->prefetch;
+    if (!pf) {
+        pf = alloc_pool_aligned(jd, sizeof(JPREFETCH));
+        if (!pf) {
+            return JDR_MEM1;
+        }
+        pf->buf = alloc_pool(jd, JD_SZBUF);     /* Second input buffer */
+        if (!pf->buf) {
+            return JDR_MEM1;
+        }
+        pf->ready = 0;
+        pf->busy = false;
+        jd->prefetch = pf;
+    } else {
+        jd_prefetch_sync(jd, pf);   /* Complete the read with the old functions */
+    }
+    pf->start = start;
+    pf->wait = wait;
+    if (!pf->busy && !pf->ready) {
+        /* Read the block next to the input buffer from now */
+        pf->start(jd, pf->buf, JD_SZBUF);
+        pf->busy = true;
+    }
+
+    return JDR_OK;
+}
+
+/*-------------------------------------------------------------------------*/
+// Band streaming
+
+typedef struct {
+    JSCANPOS pos;           /* Scan position next to the last band */
+    JRECT rect;             /* Rectangle to be streamed (clipped to the scaled image) */
+    uint16_t height;        /* Band height, multiple of the MCU height */
+    uint32_t top;           /* Top of the next band */
+} JSTREAM;
+
+JRESULT jd_stream_begin(JDEC *jd, JRECT *rect, uint16_t height)
+{
+    uint16_t mh;
+    JSTREAM *st;
+
+    if (!jd || !jd->msy) {
+        return JDR_PAR;
+    }
+
+    if (!jd->stream) {
+        st = alloc_pool_aligned(jd, sizeof(JSTREAM));
+        if (!st) {
+            return JDR_MEM1;
+        }
+        jd->stream = st;
+    }
+    st = (JSTREAM *)jd->stream;
+
+    /* Rectangle clipped to the (scaled) image */
+    st->rect.left = 0;
+    st->rect.top = 0;
+    st->rect.right = jd_scaled(jd, jd->width) - 1;
+    st->rect.bottom = jd_scaled(jd, jd->height) - 1;
+    if (rect) {
+        st->rect.left = rect->left;
+        st->rect.top = rect->top;
+        if (rect->right < st->rect.right) {
+            st->rect.right = rect->right;
+        }
+        if (rect->bottom < st->rect.bottom) {
+            st->rect.bottom = rect->bottom;
+        }
+    }
+    st->top = st->rect.top;
+    if (st->rect.left > st->rect.right) {
+        st->top = st->rect.bottom + 1;  /* Nothing to be streamed */
+    }
+
+    /* A band is whole MCU rows, so that no MCU row is decoded twice */
+    mh = (jd->msy << 3) >> jd->scale;
+    st->height = height < mh ? mh : (height + mh - 1) / mh * mh;
+    st->pos.active = false;
+
+    return JDR_OK;
+}
+
+JRESULT jd_stream_next(JDEC *jd, void *band, int32_t stride, JRECT *rect)
+{
+    JSTREAM *st;
+    JRECT full;
+    uint32_t bottom;
+    JRESULT rc;
 
-                /* CrCb */
-                if (jd->ncomp == 3) {
-                    for (i = 0; i < 2; i++) {
-                        jd->component[n + i].huff[0].huffbits = tbl->huffbits[1][0];
-                        jd->component[n + i].huff[0].huffcode = tbl->huffcode[1][0];
-                        jd->component[n + i].huff[0].huffdata = tbl->huffdata[1][0];
-                        jd->component[n + i].huff[1].huffbits = tbl->huffbits[1][1];
-                        jd->component[n + i].huff[1].huffcode = tbl->huffcode[1][1];
-                        jd->component[n + i].huff[1].huffdata = tbl->huffdata[1][1];
-                        jd->component[n + i].qttbl = tbl->qttbl[tbl->qtid[i + 1]];
-                        jd->component[n + i].dcv = &jd->dcv[i + 1];
+    if (!jd || !jd->stream || !band || !rect) {
+        return JDR_PAR;
+    }
+    st = (JSTREAM *)jd->stream;
+    if (st->top > st->rect.bottom) {
+        /* All bands have been output, the rectangle is empty */
+        rect->left = rect->top = 1;
+        rect->right = rect->bottom = 0;
+        return JDR_OK;
+    }
 
-                        JD_LOG("huff[%d]", n + i);
-                    }
-                }
+    /* Next band, up to the boundary of band height in the image */
+    bottom = (st->top / st->height + 1) * st->height - 1;
+    rect->left = st->rect.left;
+    rect->right = st->rect.right;
+    rect->top = (uint16_t)st->top;
+    rect->bottom = bottom < st->rect.bottom ? (uint16_t)bottom : st->rect.bottom;
+
+    /* Decode the band into the buffer, the scan is continued from the last band */
+    jd->fb = (uint8_t *)band;
+    jd->fbstride = stride;
+    jd->fbrect = *rect;
+    rc = jd_decomp_scan(jd, jd_unscale_rect(jd, rect, &full), 0, 0xFFFFFFFF, &st->pos);
+    jd->fb = NULL;
+    if (rc != JDR_SUSPEND) {
+        st->top = (uint32_t)rect->bottom + 1;
+    }
 
-                /* Shared buffer for IDCT (64 * sizeof(int32_t)) and RGB ((64 * sizeof(ARGB8888))) output */
-                len = 64 * 4;
-                jd->workbuf = alloc_pool(jd, len);
-                if (!jd->workbuf) {
-                    return JDR_MEM1;
-                }
+    return rc;
+}
 
-                /* Allocate MCU working buffer */
-                jd->mcubuf = alloc_pool(jd, (n + 2) * 64 * sizeof(jd_yuv_t));
-                if (!jd->mcubuf) {
-                    return JDR_MEM1;
-                }
+/*-------------------------------------------------------------------------*/
+// Lossless crop
+
+/* Standard luminance DC table (ITU-T T.81 K.3), used when the one of the stream lacks a category */
+static const uint8_t jd_std_dc_bits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t jd_std_dc_vals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+typedef struct {
+    jd_writefunc_t writefunc;   /* Output function of the new stream */
+    uint32_t reg;               /* Bits to be written (LSBs) */
+    uint8_t cnt;                /* Number of bits in reg */
+    uint8_t n;                  /* Number of bytes in buf */
+    uint8_t buf[64];            /* Output buffer */
+    int16_t pred[3];            /* DC predictor of each component */
+    JRESULT rc;                 /* Error found in the coefficient function */
+    const uint8_t *dcbits[2];   /* DC tables of the new stream [class] */
+    const uint8_t *dcvals[2];
+    uint16_t dc_code[2][12];    /* Huffman code of each DC category [class] */
+    uint8_t dc_len[2][12];      /* Its length (0: no code) */
+    uint16_t ac_code[2][256];   /* Huffman code of each AC symbol [class] */
+    uint8_t ac_len[2][256];
+} JCROP;
+
+static void jd_crop_flush(JDEC *jd, JCROP *cr)
+{
+    if (cr->n && cr->writefunc(jd, cr->buf, cr->n) != cr->n) {
+        cr->rc = JDR_INP;   /* Err: device error */
+    }
+    cr->n = 0;
+}
 
-                /* Align stream read offset to JD_SZBUF */
-                if (ofs %= JD_SZBUF) {
-                    jd->dctr = jd->infunc(jd, seg + ofs, (int32_t)(JD_SZBUF - ofs));
-                }
-                jd->dptr = seg + ofs - (JD_FASTDECODE ? 0 : 1);
-                JD_HEXDUMP(jd->dptr, jd->dctr);
+static void jd_crop_byte(JDEC *jd, JCROP *cr, uint8_t d)
+{
+    cr->buf[cr->n++] = d;
+    if (cr->n == sizeof cr->buf) {
+        jd_crop_flush(jd, cr);
+    }
+}
 
-                /* Convert to RGB */
-                if ((jd->ncomp == 1) && (jd->msx == 1) && (jd->msy == 1)) {
-                    jd->yuv_scan = yuv400_scan;
-                } else if ((jd->ncomp == 3) && (jd->msx == 1) && (jd->msy == 1)) {
-                    jd->yuv_scan = yuv444_scan;
-                } else if ((jd->ncomp == 3) && (jd->msx == 2) && (jd->msy == 2)) {
-                    jd->yuv_scan = yuv420_scan;
-                } else if ((jd->ncomp == 3) && (jd->msx == 2) && (jd->msy == 1)) {
-                    jd->yuv_scan = yuv422_scan;
-                } else {
-                    return JDR_YUV;
-                }
+static void jd_crop_word(JDEC *jd, JCROP *cr, uint16_t w)
+{
+    jd_crop_byte(jd, cr, (uint8_t)(w >> 8));
+    jd_crop_byte(jd, cr, (uint8_t)w);
+}
 
-                /* default Color format */
-                jd->color = JD_RGB888;
-                jd->yuv_fmt = jd_yuv_fmt_tab[jd->color];
+/* Put len bits (up to 16) of entropy-coded data with byte stuffing */
+static void jd_crop_bits(JDEC *jd, JCROP *cr, uint32_t code, uint8_t len)
+{
+    uint8_t d;
 
-#if JD_DEBUG
-                jd_log(jd);
-#endif
+    cr->reg = (cr->reg << len) | (code & ((1UL << len) - 1));
+    cr->cnt += len;
+    while (cr->cnt >= 8) {
+        cr->cnt -= 8;
+        d = (uint8_t)(cr->reg >> cr->cnt);
+        jd_crop_byte(jd, cr, d);
+        if (d == 0xFF) {
+            jd_crop_byte(jd, cr, 0);    /* Stuffed byte */
+        }
+    }
+    cr->reg &= (1UL << cr->cnt) - 1;
+}
 
-                return JDR_OK;      /* Initialization succeeded. Ready to decompress the JPEG image. */
-            }
-            break;
-        case 0xC1:  /* SOF1 */
-        case 0xC2:  /* SOF2 */
-        case 0xC3:  /* SOF3 */
-        case 0xC5:  /* SOF5 */
-        case 0xC6:  /* SOF6 */
-        case 0xC7:  /* SOF7 */
-        case 0xC9:  /* SOF9 */
-        case 0xCA:  /* SOF10 */
-        case 0xCB:  /* SOF11 */
-        case 0xCD:  /* SOF13 */
-        case 0xCE:  /* SOF14 */
-        case 0xCF:  /* SOF15 */
-        case 0xD9:  /* EOI */
-            return JDR_FMT3;    /* Unsuppoted JPEG standard (may be progressive JPEG) */
-        default:    /* Unknown segment (comment, exif or etc..) */
-            JD_LOG("Skip segment marker %02X,%d", marker, len);
-            /* Skip segment data (null pointer specifies to remove data from the stream) */
-            if (jd->infunc(jd, NULL, len) != len) {
-                return JDR_INP;
+/* Create the encoder table of a Huffman table (canonical code words) */
+static void jd_crop_codes(const uint8_t *bits, const uint8_t *vals, unsigned int nvals, uint16_t *code, uint8_t *len)
+{
+    unsigned int i, j, b;
+    uint16_t hc = 0;
+
+    for (i = j = 0; i < 16; i++) {
+        for (b = bits[i]; b; b--, j++) {
+            if (vals[j] < nvals) {
+                code[vals[j]] = hc;
+                len[vals[j]] = (uint8_t)(i + 1);
             }
-            break;
+            hc++;
         }
+        hc <<= 1;
     }
 }
 
-JRESULT jd_decomp_rect(JDEC *jd, jd_outfunc_t outfunc, JRECT *tgt_rect)
+/* Put a Huffman table into the DHT segment */
+static void jd_crop_table(JDEC *jd, JCROP *cr, uint8_t tc_th, const uint8_t *bits, const uint8_t *vals)
 {
-    int32_t dc = jd->dctr;
-    uint8_t *dp = jd->dptr;
-    uint8_t last_d = 0, d = 0, dbit = 0, cnt = 0, cmp = 0, cls = 0, bl0, bl1, val, zeros;
-    uint32_t dreg = 0;
-    int ebits, dcac;
-    uint8_t bits_threshold = 15, n_y, n_cmp;
-    int x = 0, y = 0;
-    bool next_huff = true;
-    JRECT _mcu_rect, *mcu_rect = &_mcu_rect;
+    unsigned int i, np;
+
+    jd_crop_byte(jd, cr, tc_th);
+    for (np = i = 0; i < 16; i++) {
+        jd_crop_byte(jd, cr, bits[i]);
+        np += bits[i];
+    }
+    for (i = 0; i < np; i++) {
+        jd_crop_byte(jd, cr, vals[i]);
+    }
+}
 
-    JCOMP *component = &jd->component[cmp];
-    jd_yuv_t *mcubuf = &jd->mcubuf[cmp << 6];   // cmp * 64
+static unsigned int jd_crop_tblsize(const uint8_t *bits)
+{
+    unsigned int i, np;
 
-    n_y = jd->msy * jd->msx; /* Number of Y blocks in the MCU */
-    if (jd->ncomp == 1) {
-        n_cmp = n_y;
-    } else if (jd->ncomp == 3) {
-        n_cmp = n_y + 2;
-    } else {
-        return JDR_FMT1;    /* Err: Supports only Grayscale and Y/Cb/Cr */
+    for (np = i = 0; i < 16; i++) {
+        np += bits[i];
     }
+    return 17 + np;
+}
 
-    memset(mcubuf + 1, 0, 63 * sizeof(jd_yuv_t));
+/* Number of bits of the magnitude of v (size category) */
+static uint8_t jd_crop_cat(int v)
+{
+    uint8_t s;
 
-    jd->outfunc = outfunc;
+    for (s = 0, v = v < 0 ? -v : v; v; v >>= 1) {
+        s++;
+    }
+    return s;
+}
 
-    /* n_y: 1, 2, 4, ncomp: 1, 3 */
-    while (1) {
-        if (dc == 0) {
-            dp = jd->inbuf; /* Top of input buffer */
-            dc = jd->infunc(jd, dp, JD_SZBUF);
-            if (!dc) {
-                JD_LOG("No more data, %d", dbit);
-                return 0 - (int)JDR_INP;    /* Err: read error or wrong stream termination */
+/* Coefficient function: re-encode a block with the DC predicted from the cropped stream */
+static int jd_crop_block(JDEC *jd, const JBLOCK *blk)
+{
+    JCROP *cr = (JCROP *)jd->crop;
+    uint8_t c = blk->cmp ? 1 : 0, s, sym;
+    unsigned int k, run;
+    int v;
+
+    /* DC difference */
+    v = blk->coef[0] - cr->pred[blk->cmp];
+    cr->pred[blk->cmp] = blk->coef[0];
+    s = jd_crop_cat(v);
+    if (s > 11 || !cr->dc_len[c][s]) {
+        cr->rc = JDR_FMT2;  /* Err: no code for the DC difference */
+        return 0;
+    }
+    jd_crop_bits(jd, cr, cr->dc_code[c][s], cr->dc_len[c][s]);
+    jd_crop_bits(jd, cr, v < 0 ? v - 1 : v, s);
+
+    /* AC coefficients in zigzag order: zero runs and values */
+    for (run = 0, k = 1; k <= blk->eob; k++) {
+        v = blk->coef[k];
+        if (!v) {
+            run++;
+            continue;
+        }
+        for (; run > 15; run -= 16) {
+            if (!cr->ac_len[c][0xF0]) {
+                cr->rc = JDR_FMT2;
+                return 0;
             }
+            jd_crop_bits(jd, cr, cr->ac_code[c][0xF0], cr->ac_len[c][0xF0]);   /* ZRL */
         }
-
-        if (dbit > 24) {
-            JD_LOG("No more buffer");
-            return 0 - (int)JDR_FMT4;    /* Err: read error or wrong stream termination */
+        s = jd_crop_cat(v);
+        sym = (uint8_t)(run << 4 | s);
+        if (!cr->ac_len[c][sym]) {
+            cr->rc = JDR_FMT2;  /* Err: no code for the symbol */
+            return 0;
+        }
+        jd_crop_bits(jd, cr, cr->ac_code[c][sym], cr->ac_len[c][sym]);
+        jd_crop_bits(jd, cr, v < 0 ? v - 1 : v, s);
+        run = 0;
+    }
+    if (blk->eob < 63) {
+        if (!cr->ac_len[c][0x00]) {
+            cr->rc = JDR_FMT2;
+            return 0;
         }
+        jd_crop_bits(jd, cr, cr->ac_code[c][0x00], cr->ac_len[c][0x00]);      /* EOB */
+    }
 
-        last_d = d;
-        d = *dp;
-        dp++;
-        dc--;
+    return cr->rc == JDR_OK;
+}
 
-        if (d == 0xFF) {
-            continue;
-        } else if (last_d == 0xFF) {
-            JD_LOG("Found marker %02X", d);
-            if (d == 0x00) {
-                JD_LOG("Padding byte");
-                dreg = (dreg & ~(0xFFFFFFFF >> dbit)) | ((uint32_t)0xFF << (32 - dbit - 8));
-                dbit += 8;
-            } else {
-                if (d == 0xD9) {
-                    JD_LOG("EOI marker");
-                    bits_threshold = 0;
-                } else {
-                    if ((d >= 0xD0) && (d <= 0xD7)) {
-                        JD_LOG("RST marker %02X", d);
-                    }
-                    continue;
-                }
-            }
-        } else {
-            dreg = (dreg & ~(0xFFFFFFFF >> dbit)) | ((uint32_t)d << (32 - dbit - 8));
-            dbit += 8;
+JRESULT jd_crop_lossless(
+    JDEC *jd,               /* Initialized decompression object */
+    JRECT *rect,            /* Rectangle to be cropped in the full size image, returns it aligned to the MCUs (in/out) */
+    jd_writefunc_t writefunc    /* Write function of the new JPEG stream */
+)
+{
+    void *pool;
+    int32_t sz_pool;
+    uint32_t mw, mh, v;
+    uint8_t n_y, ncls, qtid[3], nqt, i, j, c;
+    JCOMP *comp[3];
+    void *susp;
+    JCROP *cr;
+    JRESULT rc;
+
+    if (!jd || !rect || !writefunc || !jd->msx || sizeof(jd_yuv_t) < sizeof(int16_t)) {
+        return JDR_PAR;
+    }
+    if (rect->left > rect->right || rect->top > rect->bottom || rect->left >= jd->width || rect->top >= jd->height) {
+        return JDR_PAR;     /* Err: out of the image */
+    }
+
+    /* Align the rectangle outward to the MCU boundaries, clipped to the image */
+    mw = jd->msx << 3;
+    mh = jd->msy << 3;
+    rect->left = (uint16_t)(rect->left / mw * mw);
+    rect->top = (uint16_t)(rect->top / mh * mh);
+    v = (rect->right / mw + 1) * mw - 1;
+    rect->right = (uint16_t)(v < jd->width ? v : jd->width - 1u);
+    v = (rect->bottom / mh + 1) * mh - 1;
+    rect->bottom = (uint16_t)(v < jd->height ? v : jd->height - 1u);
+
+    /* The encoder state is taken from the pool during the crop */
+    pool = jd->pool;
+    sz_pool = jd->sz_pool;
+    cr = alloc_pool_aligned(jd, sizeof(JCROP));
+    if (!cr) {
+        return JDR_MEM1;
+    }
+    memset(cr, 0, sizeof(JCROP));
+    cr->writefunc = writefunc;
+
+    /* Components Y, Cb, Cr and their tables: class 0 for Y, 1 for Cb/Cr */
+    n_y = jd->msx * jd->msy;
+    ncls = jd->ncomp == 3 ? 2 : 1;
+    for (i = 0; i < jd->ncomp; i++) {
+        comp[i] = &jd->component[i ? n_y + i - 1 : 0];
+    }
+    for (c = 0; c < ncls; c++) {
+        JHUFF *huff = comp[c]->huff;
+
+        jd_crop_codes(huff[1].huffbits, huff[1].huffdata, 256, cr->ac_code[c], cr->ac_len[c]);
+        jd_crop_codes(huff[0].huffbits, huff[0].huffdata, 12, cr->dc_code[c], cr->dc_len[c]);
+        cr->dcbits[c] = huff[0].huffbits;
+        cr->dcvals[c] = huff[0].huffdata;
+        for (i = 0; i < 12 && cr->dc_len[c][i]; i++) ;
+        if (i < 12) {
+            /* A DC difference at the crop edges may need a category the table lacks */
+            memset(cr->dc_len[c], 0, 12);
+            jd_crop_codes(jd_std_dc_bits, jd_std_dc_vals, 12, cr->dc_code[c], cr->dc_len[c]);
+            cr->dcbits[c] = jd_std_dc_bits;
+            cr->dcvals[c] = jd_std_dc_vals;
         }
+    }
 
-        JD_LOG("Buffer: %08X %u %02X", dreg, dbit, d);
+    /* SOI, DQT */
+    jd_crop_word(jd, cr, 0xFFD8);
+    for (nqt = i = 0; i < jd->ncomp; i++) {
+        for (j = 0; j < nqt && qtid[j] != comp[i]->qtid; j++) ;
+        if (j == nqt) {
+            qtid[nqt++] = comp[i]->qtid;
+        }
+    }
+    jd_crop_word(jd, cr, 0xFFDB);
+    jd_crop_word(jd, cr, 2 + 65 * nqt);
+    for (j = 0; j < nqt; j++) {
+        for (i = 0; comp[i]->qtid != qtid[j]; i++) ;
+        jd_crop_byte(jd, cr, qtid[j]);  /* 8-bit precision */
+        for (v = 0; v < 64; v++) {      /* De-quantizer in zigzag order, without the Arai scale factor */
+            jd_crop_byte(jd, cr, (uint8_t)((uint32_t)comp[i]->qttbl[Zig[v]] / Ipsf[Zig[v]]));
+        }
+    }
 
-        while (dbit > bits_threshold) {
-            if (next_huff) {
-                cls = !!cnt;
+    /* SOF0 */
+    jd_crop_word(jd, cr, 0xFFC0);
+    jd_crop_word(jd, cr, 8 + 3 * jd->ncomp);
+    jd_crop_byte(jd, cr, 8);
+    jd_crop_word(jd, cr, rect->bottom - rect->top + 1);
+    jd_crop_word(jd, cr, rect->right - rect->left + 1);
+    jd_crop_byte(jd, cr, jd->ncomp);
+    for (i = 0; i < jd->ncomp; i++) {
+        jd_crop_byte(jd, cr, i + 1);
+        jd_crop_byte(jd, cr, i ? 0x11 : (uint8_t)(jd->msx << 4 | jd->msy));
+        jd_crop_byte(jd, cr, comp[i]->qtid);
+    }
 
-                JD_LOG("(x: %d, y: %d), cmp %u, %s table, cls %d, cnt %d, dreg %08X, dbit %u",
-                       x, y, cmp, cls == 0 ? "DC" : "AC", cls, cnt, dreg, dbit);
+    /* DHT */
+    for (v = 2, c = 0; c < ncls; c++) {
+        v += jd_crop_tblsize(cr->dcbits[c]) + jd_crop_tblsize(comp[c]->huff[1].huffbits);
+    }
+    jd_crop_word(jd, cr, 0xFFC4);
+    jd_crop_word(jd, cr, (uint16_t)v);
+    for (c = 0; c < ncls; c++) {
+        jd_crop_table(jd, cr, c, cr->dcbits[c], cr->dcvals[c]);
+        jd_crop_table(jd, cr, 0x10 | c, comp[c]->huff[1].huffbits, comp[c]->huff[1].huffdata);
+    }
 
-                bl0 = jd_get_hc(&component->huff[cls], dreg, dbit, &val);
-                if (!bl0) {
-                    JD_LOG("bl0 Huffman code too short: %08X %u", dreg, dbit);
-                    return JDR_FMT1;
-                }
+    /* SOS */
+    jd_crop_word(jd, cr, 0xFFDA);
+    jd_crop_word(jd, cr, 6 + 2 * jd->ncomp);
+    jd_crop_byte(jd, cr, jd->ncomp);
+    for (i = 0; i < jd->ncomp; i++) {
+        jd_crop_byte(jd, cr, i + 1);
+        jd_crop_byte(jd, cr, i ? 0x11 : 0x00);
+    }
+    jd_crop_byte(jd, cr, 0);
+    jd_crop_byte(jd, cr, 63);
+    jd_crop_byte(jd, cr, 0);
+
+    /* Entropy-coded data of the MCUs in the rectangle, no restart interval */
+    susp = jd->susp;
+    jd->susp = NULL;    /* The crop is not resumable */
+    jd->crop = cr;
+    rc = jd_decomp_coef(jd, jd_crop_block, rect, true);
+    jd->crop = NULL;
+    jd->susp = susp;
+    if (cr->rc != JDR_OK) {
+        rc = cr->rc;
+    }
+    if (rc == JDR_OK) {
+        jd_crop_bits(jd, cr, 0x7F, (8 - cr->cnt) & 7);     /* Pad with 1s to the byte boundary */
+        jd_crop_word(jd, cr, 0xFFD9);
+        jd_crop_flush(jd, cr);
+        rc = cr->rc;
+    }
 
-                dbit -= bl0;
-                dreg <<= bl0;
-                next_huff = false;
+    jd->pool = pool;
+    jd->sz_pool = sz_pool;
 
-                JD_LOG("processing huff, bl0 %d, val %02X", bl0, val);
+    return rc;
+}
 
-                if (val != 0) {
-                    continue;
-                }
-            }
+#if JD_MTDECODE
+/*-------------------------------------------------------------------------*/
+// Multi-threaded decoding across restart intervals
+
+typedef struct {
+    JDEC *jd;               /* Decompressor object given by the application */
+    JRECT *rect;            /* Rectangle to be decoded in the full size image (NULL: whole image) */
+    JRECT full;             /* Rectangle to be decoded mapped to the full size image */
+    JRECT fbrect;           /* Region of the image in the frame buffer */
+    jd_outfunc_t outfunc;   /* Output function of the application (NULL: frame buffer) */
+    uint8_t *fb;            /* Frame buffer */
+    int32_t stride;         /* Bytes per line of the frame buffer */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t devpos;        /* Stream offset of the input device */
+    uint32_t nint;          /* Number of restart intervals */
+    uint32_t next;          /* Next restart interval to be decoded */
+    uint32_t turn;          /* Next restart interval to be output */
+    bool staged;            /* Output is staged to keep the scan order */
+    JRESULT rc;
+} JMTCTX;
+
+typedef struct {
+    JMTCTX *ctx;
+    JDEC jd;                /* Decompressor object of the worker */
+    uint32_t pos;           /* Stream offset of the worker */
+    uint8_t *stage;         /* Staged output of a restart interval */
+    int32_t sz_stage, n_stage;
+    JRESULT rc;
+    pthread_t thread;
+} JMTWORKER;
 
-            if (!next_huff) {
-                JD_LOG("processing bits, cnt %d val %02X", cnt, val);
+static uint32_t jd_mt_next(JMTCTX *ctx, uint32_t iint)
+{
+    JDEC *jd = ctx->jd;
+    uint32_t imcu;
 
-                if ((val != 0) || (cnt == 0)) {
-                    zeros = val >> 4;
-                    bl1 = val & 0x0F;
+    if (!jd->nrst) {
+        return iint ? ctx->nint : 0;    /* Whole scan is a single interval */
+    }
+    imcu = jd_first_mcu(jd, ctx->rect, iint * jd->nrst);
+    if (imcu >= jd_mcu_count(jd)) {
+        return ctx->nint;
+    }
+    return imcu / jd->nrst;
+}
 
-                    if (dbit < bl1) {
-                        JD_LOG("bl1 Huffman code too short: %08X %u < %u", dreg, dbit, bl1);
-                        return JDR_FMT1;
-                    }
+/* Input function of workers, serializes the accesses to the input device */
+static int32_t jd_mt_input(JDEC *jd, uint8_t *buf, int32_t len)
+{
+    JMTWORKER *wk = (JMTWORKER *)jd->device;
+    JMTCTX *ctx = wk->ctx;
+    int32_t n;
 
-                    cnt += zeros;
+    if (!buf) {
+        wk->pos += len;     /* Seek is done on the next read */
+        return len;
+    }
 
-                    if (bl1) {
-                        ebits = (int)(dreg >> (32 - bl1));
-                        if (!(dreg & 0x80000000)) {
-                            ebits -= (1 << bl1) - 1;    /* Restore negative value if needed */
-                        }
-                    } else {
-                        ebits = 0;
-                    }
-                    if ((cnt == 0) || bl1) {
-                        if (cnt == 0) {
-                            /* DC component */
-                            dcac = *component->dcv + ebits;
-                            *component->dcv = dcac;
-                        } else {
-                            /* AC component */
-                            dcac = ebits;
-                        }
+    pthread_mutex_lock(&ctx->lock);
+    n = (int32_t)(wk->pos - ctx->devpos);
+    if (n < 0 ? !ctx->jd->seekfunc(ctx->jd, wk->pos) : n && ctx->jd->infunc(ctx->jd, NULL, n) != n) {
+        pthread_mutex_unlock(&ctx->lock);
+        return 0;
+    }
+    ctx->devpos = wk->pos;
+    n = ctx->jd->infunc(ctx->jd, buf, len);
+    if (n > 0) {
+        ctx->devpos += n;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (n > 0) {
+        wk->pos += n;
+    }
 
-                        /* reverse zigzag */
-                        mcubuf[Zig[cnt]] = dcac;
+    return n;
+}
 
-                        dbit -= bl1;
-                        dreg <<= bl1;
-                        cnt += 1;
-                    }
-                } else {
-                    /* EOB detected */
-                    zeros = 0;
-                    cnt = 64;
-                    ebits = 0;
-                }
+/* Seek function of workers, the device is moved on the next read */
+static int jd_mt_seek(JDEC *jd, uint32_t ofs)
+{
+    ((JMTWORKER *)jd->device)->pos = ofs;
 
-                JD_LOG("Found Huffman code: %08X %u | %u %02X %d %d %d", dreg, dbit, bl0, val, *component->dcv, ebits, dcac);
-                if (cnt == 64) {
-                    cnt = 0;
-
-                    JD_INTDUMP(mcubuf, 64);
-                    JD_LOG("");
-
-                    cmp++;
-                    if (cmp >= n_cmp) {
-                        cmp = 0;
-
-                        mcu_rect->left = x;
-                        mcu_rect->top = y;
-                        mcu_rect->right = x + (jd->msx << 3) - 1;
-                        mcu_rect->bottom = y + (jd->msy << 3) - 1;
-                        if (tgt_rect == NULL) {
-                            jd_output(jd, n_cmp, mcu_rect, tgt_rect);
-                        } else {
-                            if (is_rect_intersect(tgt_rect, mcu_rect)) {
-                                JD_LOG("MCU intersects with output rectangle (%u,%u,%u,%u) (%u,%u,%u,%u)\n",
-                                       mcu_rect->left, mcu_rect->top, mcu_rect->right, mcu_rect->bottom,
-                                       tgt_rect->left, tgt_rect->top, tgt_rect->right, tgt_rect->bottom);
-                                jd_output(jd, n_cmp, mcu_rect, tgt_rect);
-                            }
-                        }
+    return 1;
+}
 
-                        x += jd->msx << 3;
-                        if (x >= jd->width) {
-                            x = 0;
-                            y += jd->msy << 3;
-                            if (y >= jd->height) {
-                                JD_LOG("All MCUs processed (%u padding bits: %X)", dbit, dreg >> (32 - dbit));
-                                return JDR_OK;
-                            }
-                        }
-                    }
-                    component = &jd->component[cmp];
-                    mcubuf = &jd->mcubuf[cmp << 6];     // cmp * 64
+/* Output function of workers, passes through the blocks */
+static int jd_mt_direct(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    JMTCTX *ctx = ((JMTWORKER *)jd->device)->ctx;
 
-                    memset(mcubuf + 1, 0, 63 * sizeof(jd_yuv_t));
-                }
-                next_huff = true;
+    return ctx->outfunc(ctx->jd, bitmap, rect);
+}
+
+/* Output function of workers, stores the blocks until its turn */
+static int jd_mt_stage(JDEC *jd, void *bitmap, JRECT *rect)
+{
+    JMTWORKER *wk = (JMTWORKER *)jd->device;
+    int32_t sz = (rect->right - rect->left + 1) * (rect->bottom - rect->top + 1) * jd_color_bpp[jd->color];
+    uint8_t *p = wk->stage + wk->n_stage;
+
+    if (wk->n_stage + (int32_t)sizeof(JRECT) + sz > wk->sz_stage) {
+        wk->rc = JDR_MEM1;  /* Err: interval does not fit in the stage */
+        return 0;
+    }
+    memcpy(p, rect, sizeof(JRECT));
+    memcpy(p + sizeof(JRECT), bitmap, sz);
+    wk->n_stage += (sizeof(JRECT) + sz + 3) & ~3;
+
+    return 1;
+}
+
+static void *jd_mt_worker(void *arg)
+{
+    JMTWORKER *wk = (JMTWORKER *)arg;
+    JMTCTX *ctx = wk->ctx;
+    uint32_t iint, n;
+    int32_t ofs;
+    JRECT *rect;
+    JRESULT rc;
+
+    for (;;) {
+        /* Take a restart interval */
+        pthread_mutex_lock(&ctx->lock);
+        iint = ctx->next;
+        if (iint < ctx->nint) {
+            ctx->next = jd_mt_next(ctx, iint + 1);
+        }
+        rc = ctx->rc;
+        pthread_mutex_unlock(&ctx->lock);
+        if (iint >= ctx->nint || rc != JDR_OK) {
+            break;
+        }
+
+        wk->n_stage = 0;
+        wk->rc = JDR_OK;
+        if (wk->jd.rstidx) {
+            rc = jd_decomp_scan(&wk->jd, ctx->rect, iint, iint + 1, NULL);
+        } else {
+            /* No restart interval, decode the whole scan from its top */
+            rc = jd_decomp_scan(&wk->jd, ctx->rect, 0, 1, NULL);
+        }
+
+        if (rc == JDR_OK) {
+            rc = wk->rc;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (rc != JDR_OK && ctx->rc == JDR_OK) {
+            ctx->rc = rc;
+        }
+        if (ctx->staged) {
+            /* Wait for the turn of this interval and then flush the stage */
+            while (ctx->turn != iint && ctx->rc == JDR_OK) {
+                pthread_cond_wait(&ctx->cond, &ctx->lock);
+            }
+            rc = ctx->rc;
+            pthread_mutex_unlock(&ctx->lock);
+            for (ofs = 0; rc == JDR_OK && ofs < wk->n_stage; ofs += (sizeof(JRECT) + n + 3) & ~3) {
+                rect = (JRECT *)(wk->stage + ofs);
+                n = (rect->right - rect->left + 1) * (rect->bottom - rect->top + 1) * jd_color_bpp[wk->jd.color];
+                ctx->outfunc(ctx->jd, wk->stage + ofs + sizeof(JRECT), rect);
             }
+            pthread_mutex_lock(&ctx->lock);
+            ctx->turn = jd_mt_next(ctx, iint + 1);
+            pthread_cond_broadcast(&ctx->cond);
         }
+        pthread_mutex_unlock(&ctx->lock);
     }
+
+    return NULL;
 }
 
-JRESULT jd_decomp(JDEC *jd, jd_outfunc_t outfunc, uint8_t scale)
+static JRESULT jd_mt_run(JMTCTX *ctx, uint8_t nworker, void *pool, int32_t sz_pool)
 {
-    return jd_decomp_rect(jd, outfunc, NULL);
+    JDEC *jd = ctx->jd;
+    JMTWORKER *wk;
+    int32_t sz, sz_mcu;
+    uint8_t *p;
+    int i;
+
+    if (!nworker || !jd->seekfunc) {
+        return JDR_PAR;     /* Err: workers move the input device back and forth */
+    }
+
+    /* Restart intervals to be decoded */
+    if (jd->nrst) {
+        if (!jd->rstidx && jd_build_index(jd) != JDR_OK) {
+            return JDR_INP;
+        }
+        ctx->nint = (jd_mcu_count(jd) + jd->nrst - 1) / jd->nrst;
+    } else {
+        ctx->nint = 1;
+        nworker = 1;
+    }
+    ctx->next = ctx->turn = jd_mt_next(ctx, 0);
+    if (ctx->next >= ctx->nint) {
+        return JDR_OK;  /* Nothing to decode */
+    }
+    if (ctx->nint - ctx->next < nworker) {
+        nworker = ctx->nint - ctx->next;
+    }
+    ctx->staged = ctx->outfunc && nworker > 1;
+    ctx->devpos = jd->inpos + jd_prefetch_drop(jd);
+    ctx->rc = JDR_OK;
+
+    /* Carve the worker objects and their buffers from the pool, 8-byte aligned for the pointers in them */
+    p = (uint8_t *)(((uintptr_t)pool + 7) & ~(uintptr_t)7);
+    sz = ((sz_pool - (int32_t)(p - (uint8_t *)pool)) / nworker) & ~7;
+    sz_mcu = jd->msx * jd->msy * ((sizeof(JRECT) + 64 * jd_color_bpp[jd->color] + 3) & ~3);
+    for (i = 0; i < nworker; i++, p += sz) {
+        if (sz < (int32_t)sizeof(JMTWORKER)) {
+            return JDR_MEM1;
+        }
+        wk = (JMTWORKER *)p;
+        wk->ctx = ctx;
+        /* Workers share the parsed image and output per block */
+        if (jd_prepare_cursor(&wk->jd, jd, p + ((sizeof(JMTWORKER) + 3) & ~3), sz - ((sizeof(JMTWORKER) + 3) & ~3), wk) != JDR_OK) {
+            return JDR_MEM1;
+        }
+        if (!jd->mem) {     /* In-memory stream is read by all workers in place */
+            wk->jd.infunc = jd_mt_input;
+            wk->jd.seekfunc = jd_mt_seek;   /* Not the one of the application, the device is a worker */
+            wk->pos = 0;
+        }
+        wk->jd.outfunc = ctx->staged ? jd_mt_stage : jd_mt_direct;
+        if (!ctx->outfunc) {
+            /* Write the pixels into the frame buffer directly */
+            wk->jd.fb = ctx->fb;
+            wk->jd.fbstride = ctx->stride;
+            wk->jd.fbrect = ctx->fbrect;
+        }
+        wk->stage = wk->jd.pool;
+        wk->sz_stage = wk->jd.sz_pool;
+        if (ctx->staged && wk->sz_stage < (int32_t)jd->nrst * sz_mcu) {
+            return JDR_MEM1;    /* Err: no room to stage a restart interval */
+        }
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    p = (uint8_t *)(((uintptr_t)pool + 7) & ~(uintptr_t)7);
+    for (i = 0; i < nworker; i++) {
+        wk = (JMTWORKER *)(p + i * sz);
+        if (pthread_create(&wk->thread, NULL, jd_mt_worker, wk) != 0) {
+            /* Err: no resource for the thread, stop the workers already started */
+            pthread_mutex_lock(&ctx->lock);
+            ctx->rc = JDR_MEM1;
+            pthread_cond_broadcast(&ctx->cond);
+            pthread_mutex_unlock(&ctx->lock);
+            nworker = i;
+            break;
+        }
+    }
+    for (i = 0; i < nworker; i++) {
+        wk = (JMTWORKER *)(p + i * sz);
+        pthread_join(wk->thread, NULL);
+    }
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    /* Input device has been moved by the workers */
+    if (!jd->mem) {
+        jd->dptr = jd->inbuf;
+        jd->dctr = 0;
+        jd->inpos = ctx->devpos;
+    }
+
+    return ctx->rc;
 }
 
-JRESULT jd_set_color(JDEC *jd, JCOLOR color)
+JRESULT jd_decomp_mt(
+    JDEC *jd,               /* Initialized decompression object */
+    jd_outfunc_t outfunc,   /* RGB output function */
+    JRECT *rect,            /* Rectangle to be decoded (NULL: whole image) */
+    uint8_t nworker,        /* Number of worker threads */
+    void *pool,             /* Working buffer for the workers */
+    int32_t sz_pool         /* Size of working buffer */
+)
 {
-    if (!jd) {
+    JMTCTX ctx;
+
+    if (!jd || !outfunc) {
         return JDR_PAR;
     }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.jd = jd;
+    ctx.rect = jd_unscale_rect(jd, rect, &ctx.full);
+    ctx.outfunc = outfunc;
+    jd->outfunc = outfunc;
 
-    jd->color = color;
-    jd->yuv_fmt = jd_yuv_fmt_tab[jd->color];
+    return jd_mt_run(&ctx, nworker, pool, sz_pool);
+}
 
-    return JDR_OK;
+JRESULT jd_decomp_mt_fb(
+    JDEC *jd,               /* Initialized decompression object */
+    JRECT *rect,            /* Rectangle to be decoded (NULL: whole image) */
+    void *fb,               /* Frame buffer, top-left pixel is the top-left of the rectangle */
+    int32_t stride,         /* Bytes per line of the frame buffer */
+    uint8_t nworker,        /* Number of worker threads */
+    void *pool,             /* Working buffer for the workers */
+    int32_t sz_pool         /* Size of working buffer */
+)
+{
+    JMTCTX ctx;
+
+    if (!jd || !fb) {
+        return JDR_PAR;
+    }
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.jd = jd;
+    ctx.rect = jd_unscale_rect(jd, rect, &ctx.full);
+    ctx.fb = (uint8_t *)fb;
+    ctx.stride = stride;
+    ctx.fbrect.left = rect ? rect->left : 0;
+    ctx.fbrect.top = rect ? rect->top : 0;
+    ctx.fbrect.right = jd_scaled(jd, jd->width) - 1;
+    ctx.fbrect.bottom = jd_scaled(jd, jd->height) - 1;
+    if (rect && rect->right < ctx.fbrect.right) {
+        ctx.fbrect.right = rect->right;
+    }
+    if (rect && rect->bottom < ctx.fbrect.bottom) {
+        ctx.fbrect.bottom = rect->bottom;
+    }
+
+    return jd_mt_run(&ctx, nworker, pool, sz_pool);
 }
+#endif
 
 /*-------------------------------------------------------------------------*/
 // Log
@@ -67,6 +67,7 @@ typedef enum {
     JDR_FMT3,   /* 8: Not supported JPEG standard */
     JDR_FMT4,
     JDR_YUV,
+    JDR_SUSPEND,/* 11: Suspended by the input or the MCU budget, call again to resume */
 } JRESULT;
 
 /* Rectangular region in the output image */
@@ -81,19 +82,49 @@ typedef struct {
     uint8_t *huffbits;    /* Huffman bit distribution tables [id][dcac] */
     uint16_t *huffcode;   /* Huffman code word tables [id][dcac] */
     uint8_t *huffdata;    /* Huffman decoded data tables [id][dcac] */
+#if JD_FASTDECODE == 2
+    void *hufflut;        /* Fast huffman decode table for short code (uint8_t: DC, uint16_t: AC) */
+    int32_t *maxcode;     /* Largest code word of each long code length (-1: no code) */
+    int32_t *valptr;      /* Offset from code word to decoded data of each long code length */
+#endif
 } JHUFF;
 
 typedef struct {
     JHUFF huff[2];          /* Huffman tables for DC/AC components */
     int32_t *qttbl;
     int16_t *dcv;
+    uint8_t qtid;           /* Quantization table ID */
 } JCOMP;
 
+/* Quantized coefficients of a block passed by jd_decomp_coef() */
+typedef struct {
+    const int16_t *coef;    /* 64 coefficients in raster or zigzag order, not dequantized */
+    uint16_t bx, by;        /* Block position in the component (unit of block) */
+    uint8_t cmp;            /* Component 0:Y, 1:Cb, 2:Cr */
+    uint8_t qtid;           /* Quantization table ID of the component */
+    uint8_t eob;            /* Zigzag index of the last non-zero coefficient (0: DC only) */
+} JBLOCK;
+
 typedef struct JDEC JDEC;
-typedef int32_t (*jd_infunc_t)(JDEC *, uint8_t *, int32_t);
+typedef int32_t (*jd_infunc_t)(JDEC *, uint8_t *, int32_t);   /* NULL buffer: skip bytes */
+typedef int (*jd_seekfunc_t)(JDEC *, uint32_t);                 /* Move the input to a stream offset, 0: failed */
 typedef int (*jd_outfunc_t)(JDEC *, void *, JRECT *);
+typedef int (*jd_coeffunc_t)(JDEC *, const JBLOCK *);           /* 0: interrupt the decoding */
+typedef int32_t (*jd_writefunc_t)(JDEC *, const uint8_t *, int32_t);   /* Returns number of bytes written */
+typedef void (*jd_startfunc_t)(JDEC *, uint8_t *, int32_t);    /* Start reading the next bytes in background */
+typedef int32_t (*jd_waitfunc_t)(JDEC *);                       /* Wait for the read started, returns bytes read */
+typedef void (*jd_idct_t)(int32_t *src, jd_yuv_t *dst);
 typedef void (*jd_yuv_scan_t)(JDEC *, JRECT *mcu_rect, JRECT *tgt_rect);
 typedef void (*jd_yuv_fmt_t)(uint8_t **pix, int yy, int cb, int cr);
+typedef void (*jd_yuv_row_t)(uint8_t *pix, const jd_yuv_t *py, const jd_yuv_t *pcb, const jd_yuv_t *pcr, int n, int sh);
+
+/* Rectangle of jd_decomp_multi() and its output */
+typedef struct {
+    JRECT rect;             /* Rectangle in the output image */
+    jd_outfunc_t outfunc;   /* Output function of the rectangle (NULL: write into buf) */
+    void *buf;              /* Top-left of the rectangle clipped to the image */
+    int32_t stride;         /* Bytes per line of buf */
+} JREGION;
 
 typedef struct JTABLE {
     uint8_t *huffbits[2][2];    /* Huffman bit distribution tables [id][dcac] */
@@ -101,6 +132,13 @@ typedef struct JTABLE {
     uint8_t *huffdata[2][2];    /* Huffman decoded data tables [id][dcac] */
     int32_t *qttbl[4];          /* Dequantizer tables [id] */
     uint8_t qtid[3];            /* Quantization table ID of each component, Y, Cb, Cr */
+#if JD_FASTDECODE == 2
+    uint8_t longofs[2][2];      /* Table offset of long code [id][dcac] */
+    uint16_t *hufflut_ac[2];    /* Fast huffman decode tables for AC short code [id] */
+    uint8_t *hufflut_dc[2];     /* Fast huffman decode tables for DC short code [id] */
+    int32_t *maxcode[2][2];     /* Canonical decode tables for long code [id][dcac] */
+    int32_t *valptr[2][2];
+#endif
 } JTABLE;
 
 /* Decompressor object structure */
@@ -108,41 +146,81 @@ struct JDEC {
     int32_t dctr;               /* Number of bytes available in the input buffer */
     uint8_t *dptr;              /* Current data read ptr */
     uint8_t *inbuf;             /* Bit stream input buffer */
+    const uint8_t *mem;         /* JPEG stream in the memory (NULL: read by the input function) */
+    uint32_t szmem;             /* Size of the JPEG stream in the memory */
+    uint32_t mempos;            /* Read position of the in-memory stream through the input function */
+    uint32_t inpos;             /* Stream offset next to the last byte loaded into the input buffer */
+    uint32_t scanofs;           /* Stream offset of the entropy-coded data */
+    uint32_t *rstidx;           /* Stream offset of each restart interval (NULL: no index) */
 
     uint8_t msx, msy;           /* MCU size in unit of block (width, height) */
     uint8_t ncomp;              /* Number of color components 1:grayscale, 3:color */
     uint8_t color;              /* Output color space */
+    uint8_t scale;              /* Output scaling ratio 0:1/1, 1:1/2, 2:1/4, 3:1/8 */
     uint16_t nrst;              /* Restart interval */
     uint16_t width, height;     /* Size of the input image (pixel) */
     int16_t dcv[3];             /* Previous DC element of each component */
+    uint8_t eobidx[6];          /* Last zigzag index written in each block of the MCU */
     JCOMP component[6];         /* maximum 6 components, Huffman tables for Y, Cb, Cr components */
 
-#if JD_FASTDECODE == 2
-    uint8_t longofs[2][2];      /* Table offset of long code [id][dcac] */
-    uint16_t *hufflut_ac[2];    /* Fast huffman decode tables for AC short code [id] */
-    uint8_t *hufflut_dc[2];     /* Fast huffman decode tables for DC short code [id] */
-#endif
-
     void *workbuf;              /* Working buffer for IDCT and RGB output */
     jd_yuv_t *mcubuf;           /* Working buffer for the MCU */
+    int16_t *cterm;             /* Chroma terms of R, G, B for the MCU (NULL: not subsampled) */
 
     void *pool;                 /* Pointer to available memory pool */
     int32_t sz_pool;            /* Size of memory pool (bytes available) */
 
+    jd_idct_t idct;             /* Inverse-DCT of a whole block */
     jd_yuv_fmt_t yuv_fmt;
+    jd_yuv_row_t yuv_row;       /* Converts a span of pixels */
     jd_yuv_scan_t yuv_scan;
 
     jd_outfunc_t outfunc;
+    void *stripe;               /* Stripe output state (NULL: output per block) */
+    void *stream;               /* Band streaming state (NULL: not started) */
+    void *susp;                 /* Suspension state (NULL: not enabled) */
+    void *prefetch;             /* Input prefetch state (NULL: not enabled) */
+    jd_coeffunc_t coeffunc;     /* Coefficient output of jd_decomp_coef() (NULL: pixel output) */
+    bool zigzag;                /* Coefficients are passed in zigzag order */
+    void *crop;                 /* Lossless crop state (NULL: not cropping) */
+    uint8_t *fb;                /* Frame buffer to write the pixels in (NULL: output function) */
+    int32_t fbstride;           /* Bytes per line of the frame buffer */
+    JRECT fbrect;               /* Region of the image in the frame buffer */
+    JREGION *region;            /* Regions of jd_decomp_multi() (NULL: single rectangle) */
+    uint8_t nregion;            /* Number of the regions */
+    uint8_t iregion;            /* Index of the region being output */
     jd_infunc_t infunc;         /* Pointer to jpeg stream input function */
+    jd_seekfunc_t seekfunc;     /* Seek function of the input (NULL: the input only goes forward) */
     void *device;               /* Pointer to I/O device identifier for the session */
 };
 
 /* TJpgDec API functions */
 JRESULT jd_prepare(JDEC *jd, jd_infunc_t infunc, void *pool, int32_t sz_pool, void *dev);
+JRESULT jd_prepare_mem(JDEC *jd, const uint8_t *data, size_t len, void *pool, int32_t sz_pool);
+JRESULT jd_prepare_cursor(JDEC *jd, const JDEC *img, void *pool, int32_t sz_pool, void *dev);
 JRESULT jd_decomp(JDEC *jd, jd_outfunc_t outfunc, uint8_t scale);
+JRESULT jd_build_index(JDEC *jd);
 
 JRESULT jd_set_color(JDEC *jd, JCOLOR color);
+JRESULT jd_set_scale(JDEC *jd, uint8_t scale);
+JRESULT jd_set_stripe(JDEC *jd, uint16_t span);
+JRESULT jd_clear_stripe(JDEC *jd);
 JRESULT jd_decomp_rect(JDEC *jd, jd_outfunc_t outfunc, JRECT *rect);
+JRESULT jd_decomp_to_buffer(JDEC *jd, JRECT *rect, void *dst, int32_t stride);
+JRESULT jd_decomp_dc(JDEC *jd, void *dst, int32_t stride);
+JRESULT jd_decomp_multi(JDEC *jd, JREGION *region, uint8_t nregion);
+JRESULT jd_decomp_coef(JDEC *jd, jd_coeffunc_t coeffunc, JRECT *rect, bool zigzag);
+JRESULT jd_crop_lossless(JDEC *jd, JRECT *rect, jd_writefunc_t writefunc);
+JRESULT jd_set_suspend(JDEC *jd, uint32_t budget);                             /* JDR_PAR with input prefetch */
+JRESULT jd_set_seek(JDEC *jd, jd_seekfunc_t seekfunc);
+JRESULT jd_set_prefetch(JDEC *jd, jd_startfunc_t start, jd_waitfunc_t wait);   /* JDR_PAR with suspension */
+JRESULT jd_stream_begin(JDEC *jd, JRECT *rect, uint16_t height);
+JRESULT jd_stream_next(JDEC *jd, void *band, int32_t stride, JRECT *rect);
+
+#if JD_MTDECODE
+JRESULT jd_decomp_mt(JDEC *jd, jd_outfunc_t outfunc, JRECT *rect, uint8_t nworker, void *pool, int32_t sz_pool);
+JRESULT jd_decomp_mt_fb(JDEC *jd, JRECT *rect, void *fb, int32_t stride, uint8_t nworker, void *pool, int32_t sz_pool);
+#endif
 
 #ifdef __cplusplus
 }
@@ -17,7 +17,8 @@
 #ifndef DEF_TJPGDCNF
 #define DEF_TJPGDCNF
 
-/* Specifies size of stream input buffer */
+/* Specifies size of stream input buffer. DHT/DQT segments are read in parts, so 32 bytes
+/  is enough for the headers (SOF and SOS segments must fit in the buffer) */
 #ifndef JD_SZBUF
 #   define JD_SZBUF                     256
 #endif
@@ -39,6 +40,39 @@
 #   define JD_FASTDECODE                1
 #endif
 
+/* SIMD kernels for x86 (needs SSE2, the baseline of x86-64, and JD_FASTDECODE >= 1)
+/  0: Disable
+/  1: SSE2
+/  2: SSE2, and the AVX2 IDCT on the CPUs having it (checked at run time, GCC or Clang)
+*/
+#ifndef JD_SIMD
+#   define JD_SIMD                      2
+#endif
+
+/* Switches output descaling feature (1/2, 1/4 and 1/8 by reduced IDCTs)
+/  0: Disable
+/  1: Enable jd_set_scale()
+*/
+#ifndef JD_USE_SCALE
+#   define JD_USE_SCALE                 1
+#endif
+
+/* Output formats to have specialized conversion kernels for each sampling, a bit per JCOLOR
+/  (0x01: JD_GRAYSCALE, 0x02: JD_RGB565, 0x04: JD_BGR565, 0x08: JD_RGB888, 0x10: JD_BGR888,
+/   0x20: JD_RGBA8888, 0x40: JD_BGRA8888). The other formats use the generic kernels.
+*/
+#ifndef JD_SCAN_COLORS
+#   define JD_SCAN_COLORS               0x7F
+#endif
+
+/* Multi-threaded decoding across restart intervals (needs POSIX threads)
+/  0: Disable
+/  1: Enable jd_decomp_mt()
+*/
+#ifndef JD_MTDECODE
+#   define JD_MTDECODE                  0
+#endif
+
 /* Debugging options
 /  0: Disable
 /  1: Enable